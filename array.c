@@ -1,5 +1,9 @@
 #include "array.h"
 
+#include <errno.h>
+
+// sem_wait that isn't cut short by a signal landing on the calling thread
+static void sem_wait_intr(sem_t *sem);
 
 int  array_init(array *s) {
     if (s == NULL) return -1;
@@ -7,13 +11,14 @@ int  array_init(array *s) {
     sem_init(&s->mutex, 0, 1);
     sem_init(&s->available_items, 0, ARRAY_SIZE);
     sem_init(&s->free_items, 0, 0);
+    sem_init(&s->idle_items, 0, ARRAY_IDLE_SIZE);
     s->size = 0;
     return 0;
 }
 
 int  array_put (array *s, pthread_t *thread) {
-    sem_wait(&s->available_items);
-      sem_wait(&s->mutex);
+    sem_wait_intr(&s->available_items);
+      sem_wait_intr(&s->mutex);
             // s->arr[s->size++] = thread;
             for (int i = 0; i < ARRAY_SIZE; i++) {
               if (s->arr[i] == NULL) {
@@ -27,9 +32,24 @@ int  array_put (array *s, pthread_t *thread) {
     return 0;
 }
 
+int  array_try_put (array *s, pthread_t *thread) {
+    if (sem_trywait(&s->available_items) < 0) return -1;
+      sem_wait_intr(&s->mutex);
+            for (int i = 0; i < ARRAY_SIZE; i++) {
+              if (s->arr[i] == NULL) {
+                s->arr[i] = thread;
+                s->size++;
+                break;
+              }
+            }
+      sem_post(&s->mutex);
+    sem_post(&s->free_items);
+    return 0;
+}
+
 int  array_get (array *s, pthread_t *thread_id) {
-    sem_wait(&s->free_items);
-      sem_wait(&s->mutex);
+    sem_wait_intr(&s->free_items);
+      sem_wait_intr(&s->mutex);
         for (int i = 0; i < ARRAY_SIZE; i++) {
           if (s->arr[i] == thread_id) {
             s->arr[i] = NULL;
@@ -42,15 +62,41 @@ int  array_get (array *s, pthread_t *thread_id) {
     return 0;
 }
 
+int  array_idle(array *s, pthread_t *thread) {
+    if (sem_trywait(&s->idle_items) < 0) return -1;
+    return array_get(s, thread);
+}
+
+int  array_wake(array *s, pthread_t *thread) {
+    sem_post(&s->idle_items);
+    return array_try_put(s, thread);
+}
+
+void array_idle_end(array *s) {
+    sem_post(&s->idle_items);
+}
+
+void array_drain(array *s) {
+    // holding every free slot means nothing is left in the array, the idle ones can't wake
+    // after that and are waited for too
+    for (int i = 0; i < ARRAY_SIZE; i++) sem_wait_intr(&s->available_items);
+    for (int i = 0; i < ARRAY_IDLE_SIZE; i++) sem_wait_intr(&s->idle_items);
+}
+
+static void sem_wait_intr(sem_t *sem) {
+    while (sem_wait(sem) < 0 && errno == EINTR);
+}
+
 void array_free(array *s) {
     sem_destroy(&s->available_items);
     sem_destroy(&s->free_items);
+    sem_destroy(&s->idle_items);
     sem_destroy(&s->mutex);
 }
 
 void array_end(array *s, char *signal) {
-    sem_wait(&s->available_items);
-      sem_wait(&s->mutex);
+    sem_wait_intr(&s->available_items);
+      sem_wait_intr(&s->mutex);
             // strncpy(s->arr[s->size++], s->arr[0], MAX_NAME_LENGTH);
             // strncpy(s->arr[0], signal, MAX_NAME_LENGTH);
       sem_post(&s->mutex);
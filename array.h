@@ -9,7 +9,8 @@
 #include <stdio.h>
 #include <pthread.h>
 
-#define ARRAY_SIZE 20
+#define ARRAY_SIZE 128
+#define ARRAY_IDLE_SIZE 512 // elements that may sit idle outside the array at once
 
 typedef struct {
     pthread_t * arr[ARRAY_SIZE];
@@ -17,6 +18,7 @@ typedef struct {
     sem_t mutex;
     sem_t available_items;
     sem_t free_items;
+    sem_t idle_items; // idle places left
 } array;
 
 // initialize the array
@@ -25,9 +27,24 @@ int  array_init(array *s);
 // place element into the array, block when full
 int  array_put (array *s, pthread_t *thread);
 
+// place element into the array, return -1 instead of blocking when full
+int  array_try_put (array *s, pthread_t *thread);
+
 // remove element from the array, block when empty
 int  array_get (array *s, pthread_t *thread_id);
 
+// move an element out of the array while it is idle, returns -1 and leaves it in when too many are idle
+int  array_idle(array *s, pthread_t *thread);
+
+// move an idle element back into the array, returns -1 instead of blocking when full, it is then in neither
+int  array_wake(array *s, pthread_t *thread);
+
+// an idle element leaving without coming back
+void array_idle_end(array *s);
+
+// block until every element has been removed and every idle one has ended, no more can be added afterwards
+void array_drain(array *s);
+
 // free the array's resources
 void array_free(array *s);
 
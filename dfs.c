@@ -4,6 +4,7 @@
  * 21 February 2025
  */
 
+#define _GNU_SOURCE // accept4, pipe2
 
 #include <stdio.h>
 #include <unistd.h>
@@ -22,9 +23,29 @@
 #include <pthread.h>
 #include <string.h>
 #include <sys/sendfile.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include "array.h"
+#include "sched.h"
+#include "tls.h"
 
 #define BUFFERSIZE 2048
+#define MAX_ACCEPTORS 16
+#define DEFAULT_BACKLOG 128
+#define LISTEN_FDS_ENV "DFS_LISTEN_FDS" // listening sockets passed to a new binary on handover
+#define READY_FD_ENV "DFS_READY_FD" // pipe the new binary writes a byte to once it is accepting
+#define HANDOVER_TIMEOUT_MS 10000 // how long the new binary has to start accepting
+#define SEND_CHUNK 65536 // bytes sent between bandwidth checks on a get
+#define IDLE_TIMEOUT_MS 5000 // how long a connection may sit between requests
+#define TLS_CERT_ENV "DFS_TLS_CERT" // certificate chain, setting it and TLS_KEY_ENV turns on TLS
+#define TLS_KEY_ENV "DFS_TLS_KEY"
+#define TLS_CA_ENV "DFS_TLS_CA" // signs the other servers' certificates for chain puts, defaults to TLS_CERT_ENV
+#define PEERS_ENV "DFS_PEERS" // comma separated host:port of the other servers, the only ones chain puts go to
+#define MAX_PEERS 16
+#define PARTIAL_EXPIRY 86400 // seconds an interrupted put's partial part is kept for it to resume
+#define REPLICA_CONNECT_MS 1000 // how long to wait on a replica's connect before the client is left to send its copy
+#define REPLICA_TIMEOUT 5 // seconds a stalled replica may block a send or its ack before the primary stores alone
 
 // argument struct for socket_handler function
 typedef struct {
@@ -36,12 +57,38 @@ typedef struct {
     pthread_t* thread_id;
 } socket_arg_t;
 
+// argument struct for acceptor function, one per listening socket
+typedef struct {
+    int listenfd;
+    struct sockaddr_in serveraddr;
+    socklen_t addrlen;
+} acceptor_arg_t;
+
 // multi-thread function to handle new socket connections
 void* socket_handler(void* arg);
 
+// waits for the next request on a connection, returns 0 if it went idle too long or we are draining
+int wait_request(int clientfd);
+
+// serves one request from a client, returns 1 if the connection can take another
+int handle_request(int clientfd);
+
 // matches a file suffix with a file type
 int find_file_type(char* file_name);
 
+// resolves a server given as host:port, host is filled with the host part, returns 0 or -1
+int resolve_peer(char* peer, char* host, struct sockaddr_in* addr);
+
+// connects to the next server of a chain put given as host:port, returns the socket or -1
+// if it isn't one of the peers, is down or doesn't connect in time
+int replica_connect(char* next);
+
+// forwards a chunk of a chain put to the replica, dropping the replica if it fails
+void forward(int* replicafd, char* data, int len);
+
+// waits for the replica of a chain put to acknowledge its copy
+int replica_stored(int replicafd);
+
 /*
 * error - wrapper for perror
 */
@@ -50,31 +97,69 @@ void error(char *msg) {
     exit(1);
 }
 
-// sigint handler
-void sigint_handler(int sig);
+// removes the partials a committed part makes useless: older puts of the same part, and any left too long
+void remove_stale_partials(char* part_name);
+
+// whether an address is one of the peers, which may send the replica legs of chain puts
+int is_peer(in_addr_t addr);
+
+// sorts a parsed request into a scheduling class
+sched_class_t classify(char req[5][BUFFERSIZE/2]);
+
+// signal handler, forwards the signal to the main thread through signal_pipe
+void signal_handler(int sig);
+
+// accept loop run by each acceptor thread
+void* acceptor(void* arg);
+
+// starts the new binary on the same listening sockets and waits for it to accept on them,
+// returns its pid or -1 if it didn't start
+pid_t handover(char** argv, acceptor_arg_t* acceptors, int num_acceptors);
 
 // global values
 array socks; // semaphores used, thread safe
+sched_t sched; // admission and fair sharing of request slots, thread safe
 char server_dir[BUFFERSIZE]; // read only after main function initialization
+char server_exe[BUFFERSIZE]; // path of this binary, what a handover starts, read only after initialization
+int signal_pipe[2]; // written by signal_handler, read by the main thread
+int stop_pipe[2]; // write end is closed to stop the acceptors
+SSL_CTX* tls_server; // accepts client connections, NULL when serving plaintext
+SSL_CTX* tls_client; // connects to chain replicas, NULL when serving plaintext
+struct sockaddr_in peers[MAX_PEERS]; // servers chain puts may be forwarded to, read only after initialization
+int num_peers;
 
 int main(int argc, char** argv) {
-    int sockfd, new_socket;
     int portno;
     int optval;
-    struct sockaddr_in serveraddr;
-    socklen_t addrlen = sizeof(serveraddr);
+    int backlog = DEFAULT_BACKLOG;
+    long client_bw = 0;
+    int num_acceptors = sysconf(_SC_NPROCESSORS_ONLN);
+    acceptor_arg_t acceptors[MAX_ACCEPTORS];
+    pthread_t acceptor_ids[MAX_ACCEPTORS];
+    char* inherited = getenv(LISTEN_FDS_ENV);
 
     /* 
     * check command line arguments
     */
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s <server directory> <port>\n", argv[0]);
+    if (argc < 3 || argc > 6) {
+        fprintf(stderr, "usage: %s <server directory> <port> [acceptors] [backlog] [client bytes/s]\n", argv[0]);
         exit(1);
     }
     portno = atoi(argv[2]);
+    if (argc > 3) num_acceptors = atoi(argv[3]);
+    if (argc > 4) backlog = atoi(argv[4]);
+    if (argc > 5) client_bw = atol(argv[5]);
+    if (num_acceptors < 1) num_acceptors = 1;
+    if (num_acceptors > MAX_ACCEPTORS) num_acceptors = MAX_ACCEPTORS;
 
     strncpy(server_dir, argv[1], BUFFERSIZE);
 
+    // resolved now rather than at handover, so an upgrade installed over this path is what gets started
+    // even if we were found through PATH or the working directory changes
+    ssize_t exe_len = readlink("/proc/self/exe", server_exe, BUFFERSIZE-1);
+    if (exe_len < 0) error("ERROR finding server binary");
+    server_exe[exe_len] = '\0';
+
     // check/create server dir
     struct stat st = {0};
     if (stat(argv[1], &st) == -1) {
@@ -82,93 +167,310 @@ int main(int argc, char** argv) {
     }
 
     // set up signal handling
-    signal(SIGINT, sigint_handler);
+    // clients may hang up mid reply (e.g. a cancelled hedged get), which must not kill the server
+    if (pipe2(signal_pipe, O_CLOEXEC) < 0 || pipe2(stop_pipe, O_CLOEXEC) < 0) error("ERROR opening pipe");
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGUSR2, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    // set up TLS if a certificate was given, the environment carries it over a handover
+    if (getenv(TLS_CERT_ENV) && getenv(TLS_KEY_ENV)) {
+        char* ca = getenv(TLS_CA_ENV) ? getenv(TLS_CA_ENV) : getenv(TLS_CERT_ENV);
+        if (!(tls_server = tls_server_ctx(getenv(TLS_CERT_ENV), getenv(TLS_KEY_ENV)))) error("ERROR loading TLS certificate");
+        if (!(tls_client = tls_client_ctx(ca))) error("ERROR loading TLS CA");
+    }
+
+    // the next server of a chain put is named by the client, so only forward to the servers we were told about
+    // without any every chain put is stored here alone and the client sends the replica's copy
+    if (getenv(PEERS_ENV)) {
+        char peer_list[BUFFERSIZE];
+        char host[BUFFERSIZE];
+        strncpy(peer_list, getenv(PEERS_ENV), BUFFERSIZE-1);
+        peer_list[BUFFERSIZE-1] = '\0';
+        for (char* tmp = strtok(peer_list, ","); tmp && num_peers < MAX_PEERS; tmp = strtok(NULL, ",")) {
+            if (resolve_peer(tmp, host, &peers[num_peers++]) < 0) error("ERROR resolving peer");
+        }
+    }
 
-    // initialize shared array
+    // initialize shared array and scheduler
     array_init(&socks);
-    
-    // socket: create the parent socket 
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) error("ERROR opening socket");
-
-    optval = 1;
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
-
-    
-    // build the server's Internet address
-    bzero((char *) &serveraddr, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serveraddr.sin_port = htons((unsigned short)portno);
-
-    
-    // bind: associate the parent socket with a port 
-    if (bind(sockfd, (struct sockaddr *) &serveraddr, addrlen) < 0) error("ERROR on binding");
-    
-
-    // main loop, listen for sockets and deal with them
+    sched_init(&sched, client_bw);
+
+    if (inherited) {
+        // started by handover, take over the old server's listening sockets
+        // so connections queued on them are not dropped, making sure they are non-blocking
+        // (the flag is shared with the old server, whose acceptors must not sleep in accept either)
+        char* tmp = strtok(inherited, ",");
+        for (num_acceptors = 0; tmp && num_acceptors < MAX_ACCEPTORS; num_acceptors++) {
+            acceptors[num_acceptors].listenfd = atoi(tmp);
+            fcntl(acceptors[num_acceptors].listenfd, F_SETFL, fcntl(acceptors[num_acceptors].listenfd, F_GETFL) | O_NONBLOCK);
+            tmp = strtok(NULL, ",");
+        }
+        unsetenv(LISTEN_FDS_ENV);
+    } else {
+        // one listening socket per acceptor, SO_REUSEPORT lets the kernel spread connections across them
+        for (int i = 0; i < num_acceptors; i++) {
+            struct sockaddr_in serveraddr;
+            int sockfd;
+
+            // socket: create the parent socket
+            // non-blocking, since the acceptors race each other (and a handed over binary) for each connection
+            if ((sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) error("ERROR opening socket");
+
+            optval = 1;
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (const void *)&optval , sizeof(int));
+
+            // build the server's Internet address
+            bzero((char *) &serveraddr, sizeof(serveraddr));
+            serveraddr.sin_family = AF_INET;
+            serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+            serveraddr.sin_port = htons((unsigned short)portno);
+
+            // bind: associate the parent socket with a port 
+            if (bind(sockfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0) error("ERROR on binding");
+            if (listen(sockfd, backlog) < 0) error("ERROR on listen");
+
+            acceptors[i].listenfd = sockfd;
+        }
+    }
+
+    // start accepting
+    for (int i = 0; i < num_acceptors; i++) {
+        acceptors[i].addrlen = sizeof(acceptors[i].serveraddr);
+        pthread_create(&acceptor_ids[i], NULL, acceptor, &acceptors[i]);
+    }
+
+    // started by handover, tell the old server we are accepting so it can stop
+    if (getenv(READY_FD_ENV)) {
+        int ready_fd = atoi(getenv(READY_FD_ENV));
+        write(ready_fd, "", 1);
+        close(ready_fd);
+        unsetenv(READY_FD_ENV);
+    }
+
+    // wait for a shutdown (SIGINT/SIGTERM) or upgrade (SIGUSR2) signal
+    // on upgrade the new binary inherits the listening sockets before we stop accepting,
+    // connections arriving in between are taken by either of us or wait in the listen backlog,
+    // and if the new binary doesn't come up we just keep serving
+    unsigned char sig = 0;
+    while (sig != SIGINT && sig != SIGTERM && sig != SIGUSR2) {
+        if (read(signal_pipe[0], &sig, 1) < 0 && errno != EINTR) error("ERROR reading signal pipe");
+        if (sig == SIGUSR2 && handover(argv, acceptors, num_acceptors) < 0) {
+            fprintf(stderr, "ERROR in handover, new server didn't start\n");
+            sig = 0;
+        }
+    }
+
+    // stop the acceptors, then wait for the requests in flight to finish
+    close(stop_pipe[1]);
+    for (int i = 0; i < num_acceptors; i++) {
+        pthread_join(acceptor_ids[i], NULL);
+        close(acceptors[i].listenfd);
+    }
+    array_drain(&socks);
+    array_free(&socks);
+    sched_free(&sched);
+    if (tls_server) SSL_CTX_free(tls_server);
+    if (tls_client) SSL_CTX_free(tls_client);
+
+    if (sig == SIGUSR2) printf("Server handed over on SIGUSR2\n");
+    else printf("Server closed on %s\n", sig == SIGINT ? "SIGINT" : "SIGTERM");
+    return 0;
+}
+
+void signal_handler(int sig) {
+    unsigned char c = sig;
+    int saved_errno = errno;
+    write(signal_pipe[1], &c, 1);
+    errno = saved_errno;
+}
+
+void* acceptor(void* arg) {
+    acceptor_arg_t* acceptor_arg = (acceptor_arg_t *) arg;
+    struct pollfd fds[2];
+    pthread_attr_t attr;
+    int new_socket;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    fds[0].fd = acceptor_arg->listenfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_pipe[0];
+    fds[1].events = POLLIN;
+
+    // accept loop, runs until the stop pipe is closed
     while (1) {
-        // wait for new connection to be prompted
-        if (listen(sockfd, 5) < 0) error("ERROR on listen");
-        
-        // create new fd for that socket
-        if ((new_socket = accept(sockfd, (struct sockaddr *) &serveraddr, &addrlen)) < 0) error("ERROR accepting new socket");
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            error("ERROR in poll");
+        }
+        if (fds[1].revents) break;
+
+        // create new fd for that socket, another acceptor may have taken it first, in which case
+        // the non-blocking listener fails with EAGAIN rather than waiting for the next connection
+        // close on exec keeps a handed over binary from holding our clients open, and the accepted
+        // socket doesn't inherit O_NONBLOCK so the handlers still block
+        if ((new_socket = accept4(acceptor_arg->listenfd, (struct sockaddr *) &acceptor_arg->serveraddr, &acceptor_arg->addrlen, SOCK_CLOEXEC)) < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) continue;
+            error("ERROR accepting new socket");
+        }
+
+        // when every thread slot is taken answer busy now instead of blocking the acceptor,
+        // a TLS client can't read a plaintext reply and takes the connection closing during its handshake as busy
+        pthread_t* thread_id = malloc(sizeof(pthread_t));
+        if (array_try_put(&socks, thread_id) < 0) {
+            if (!tls_server) send(new_socket, "BUSY", sizeof("BUSY"), 0);
+            close(new_socket);
+            free(thread_id);
+            continue;
+        }
 
         // create new pthread to handle socket request
         // this pointer will eventually be removed from scopre without freeing the memmory
         // the memmory will be freed when the socket is successfully completed
-        pthread_t* thread_id = malloc(sizeof(pthread_t));
         
         // init arguments for new thread
         socket_arg_t* socket_arg = malloc(sizeof(socket_arg_t)); // will also be freed later
-        socket_arg->addrlen = &addrlen;
+        socket_arg->addrlen = &acceptor_arg->addrlen;
         socket_arg->clientfd = new_socket;
-        socket_arg->serveraddr = &serveraddr;
-        socket_arg->serverfd = sockfd;
+        socket_arg->serveraddr = &acceptor_arg->serveraddr;
+        socket_arg->serverfd = acceptor_arg->listenfd;
         socket_arg->arr = &socks;
-
-        // create thread
-        pthread_create(thread_id, NULL, socket_handler, socket_arg);
-
-        // update args
         socket_arg->thread_id = thread_id;
 
-        // add new thread to array
-        array_put(&socks, thread_id);
-
-        // detatch thread so resources are unallocated independent of parent thread
-        pthread_detach(*thread_id);
+        // create detached thread so resources are unallocated independent of parent thread
+        pthread_create(thread_id, &attr, socket_handler, socket_arg);
     }
+
+    pthread_attr_destroy(&attr);
+    return NULL;
 }
 
-void sigint_handler(int sig) {
-    // wait for all sockets to finish computing
-    while (socks.size);
-    array_free(&socks);
-    printf("Server closed on SIGINT\n");
-    exit(0);
+pid_t handover(char** argv, acceptor_arg_t* acceptors, int num_acceptors) {
+    char fds[BUFFERSIZE] = {0};
+    char ready_fd[BUFFERSIZE];
+    int ready_pipe[2];
+    char ready;
+
+    for (int i = 0; i < num_acceptors; i++)
+        sprintf(fds+strlen(fds), i ? ",%d" : "%d", acceptors[i].listenfd);
+    if (pipe2(ready_pipe, O_CLOEXEC) < 0) return -1;
+    sprintf(ready_fd, "%d", ready_pipe[1]);
+
+    // the listening sockets are the only descriptors without close on exec,
+    // besides the write end of the ready pipe in the child, so they are all the new binary inherits
+    setenv(LISTEN_FDS_ENV, fds, 1);
+    setenv(READY_FD_ENV, ready_fd, 1);
+    pid_t pid = fork();
+    if (pid == 0) {
+        fcntl(ready_pipe[1], F_SETFD, 0);
+        execv(server_exe, argv);
+        _exit(1);
+    }
+    unsetenv(LISTEN_FDS_ENV);
+    unsetenv(READY_FD_ENV);
+    close(ready_pipe[1]);
+
+    // the pipe closes without the byte if the exec fails or the new binary dies before accepting,
+    // one that is still starting after the timeout is stopped so it can't serve alongside us later
+    struct pollfd fd = {ready_pipe[0], POLLIN, 0};
+    int started = pid > 0 && poll(&fd, 1, HANDOVER_TIMEOUT_MS) > 0 && read(ready_pipe[0], &ready, 1) == 1;
+    close(ready_pipe[0]);
+    if (pid > 0 && !started) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    return started ? pid : -1;
 }
 
 void* socket_handler(void* arg) {
     socket_arg_t* args = (socket_arg_t *) arg;
+
+    int active = 1; // holding a slot in the array, otherwise counted idle
+
+    // serve requests until the client hangs up, goes idle or a request fails
+    // the handshake happens here rather than in the acceptor so a slow client only holds up its own thread
+    // between requests a kept alive connection gives its slot back, so only connections with
+    // a request in hand count against the threads serving at once
+    if (!tls_server || tls_accept(tls_server, args->clientfd) == 0) {
+        while (wait_request(args->clientfd)) {
+            if (!active && array_wake(args->arr, args->thread_id) < 0) {
+                tls_send(args->clientfd, "BUSY", sizeof("BUSY"));
+                break;
+            }
+            active = 1;
+            if (!handle_request(args->clientfd) || array_idle(args->arr, args->thread_id) < 0) break;
+            active = 0;
+        }
+    }
+
+    // socket no longer needed
+    tls_close(args->clientfd);
+
+    // remove current thread from global array
+    if (active) array_get(args->arr, args->thread_id);
+    else array_idle_end(args->arr);
+
+    // free memory alocated by malloc from main thread
+    free(args->thread_id);
+    free(args);
+    return NULL;
+}
+
+int wait_request(int clientfd) {
+    struct pollfd fds[2];
+
+    // give up on idle connections and, once we are draining, on connections with nothing already sent
+    fds[0].fd = clientfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_pipe[0];
+    fds[1].events = POLLIN;
+    return tls_pending(clientfd) || (poll(fds, 2, IDLE_TIMEOUT_MS) > 0 && fds[0].revents);
+}
+
+int handle_request(int clientfd) {
     char buf[BUFFERSIZE];
-    char token_buf[BUFFERSIZE];
+    char token_buf[BUFFERSIZE+1];
     bzero(buf, BUFFERSIZE);
+    bzero(token_buf, BUFFERSIZE+1);
     unsigned long file_size;
     int n;
 
     // read in message
-    if ((n = read(args->clientfd, buf, BUFFERSIZE)) < 0) error("ERROR in reading from socket");
+    if ((n = tls_recv(clientfd, buf, BUFFERSIZE)) <= 0) return 0;
     strncpy(token_buf, buf, n);
     // parse message
-    char req[3][BUFFERSIZE/2]; // req[0]=command ; req[1]=file ; req[3]=file_size
+    char req[5][BUFFERSIZE/2]; // req[0]=command ; req[1]=file ; req[2]=file_size or get offset ; req[3]=next server in a chain put or get length ; req[4]=put offset
     char* tmp;
-    for (int i = 0; i < 3; i++) {
+    for (int i = 0; i < 5; i++) {
         if (i == 0) tmp = strtok(token_buf, " ");
         else tmp = strtok(NULL, " ");
+        if (!tmp) tmp = "NULL";
         memcpy(req[i], tmp, strlen(tmp)+1);
     }
 
+    // bandwidth limits are kept per client address
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    bzero(&peer, sizeof(peer));
+    getpeername(clientfd, (struct sockaddr *) &peer, &peer_len);
+    in_addr_t client = peer.sin_addr.s_addr;
+
+    // the replica leg of a chain put gets slots of its own, only the other servers may use them
+    if (!strncmp(req[0], "RPUT", BUFFERSIZE) && !is_peer(client)) return 0;
+
+    // wait for a slot, or tell the client to come back later if its class is backed up
+    sched_class_t class = classify(req);
+    if (sched_admit(&sched, class) < 0) {
+        tls_send(clientfd, "BUSY", sizeof("BUSY"));
+        return 0;
+    }
+
     // handle command:
+    int keep = 1;
     if (!strncmp(req[0], "LIST", BUFFERSIZE)) {
         struct dirent *de;
         DIR *dr; 
@@ -177,56 +479,274 @@ void* socket_handler(void* arg) {
         while ((de = readdir(dr)) != NULL) {
             if (de->d_name[0] == '.') continue;
 
-            if (send(args->clientfd, de->d_name, strlen(de->d_name)+1, 0) < 0) error("ERROR in send");
+            if (tls_send(clientfd, de->d_name, strlen(de->d_name)+1) < 0) {keep = 0; break;}
         }
 
-        if (send(args->clientfd, "END_SEND", strlen("END_SEND")+1, 0) < 0) error("ERROR in send");
+        // a client that hung up just misses the end marker
+        if (tls_send(clientfd, "END_SEND", strlen("END_SEND")+1) < 0) keep = 0;
         closedir(dr);
-    } else if (!strncmp(req[0], "PUT", BUFFERSIZE)) {
+    } else if (!strncmp(req[0], "PUT", BUFFERSIZE) || !strncmp(req[0], "CPUT", BUFFERSIZE) ||
+               !strncmp(req[0], "SPUT", BUFFERSIZE) || !strncmp(req[0], "RPUT", BUFFERSIZE)) {
+        // CPUT is a chain put, the part is forwarded to req[3] while it is written here
+        // and the client is only acknowledged once every copy in the chain is stored,
+        // RPUT is the replica's end of one, sent by the primary and acknowledged like a CPUT,
+        // SPUT is a CPUT that is told GO before the data is sent, for a client that can't send it twice
+        int chain = req[0][0] != 'P';
+        int replicafd = -1;
         unsigned long rec;
         char file_name[BUFFERSIZE*2];
+        char partial_name[BUFFERSIZE*2];
+        char header[BUFFERSIZE*4];
 
         file_size = strtol(req[2], NULL, 10);
-        // open file
-        sprintf(file_name, "./%s/%s", server_dir, req[1]);
-        FILE* file = fopen(file_name, "w");
-
-        rec = 0;
-        while (rec < file_size) {
-            if (rec == 0) {
-                fwrite(buf+strlen(buf)+1, 1, n - strlen(buf) - 1, file);
-                rec += n-strlen(buf) - 1;
+
+        // req[4] is where the data starts within the part, a put resumed after an interruption
+        // appends to what an earlier put left and must not start past it
+        unsigned long offset = strtoul(req[4], NULL, 10);
+
+        // the part is written under a hidden name and only takes its real one once it is whole,
+        // so LIST and GET never see a part cut short
+        sprintf(file_name, "%s/%s", server_dir, req[1]);
+        sprintf(partial_name, "%s/.%s", server_dir, req[1]);
+        FILE* file = fopen(partial_name, offset ? "r+e" : "we");
+        if (file && offset) {
+            struct stat st;
+            if (fstat(fileno(file), &st) < 0 || st.st_size < offset || ftruncate(fileno(file), offset) < 0) {
+                fclose(file);
+                file = NULL;
             } else {
-                if ((n = recv(args->clientfd, buf, BUFFERSIZE, 0)) < 0) error("ERROR in recv");
-                rec += n;
-                if (n == 0) break;
-                fwrite(buf, 1, n, file);
+                fseek(file, offset, SEEK_SET);
+            }
+        }
+        if (!file) {
+            if (chain) tls_send(clientfd, "PUT_FAIL", sizeof("PUT_FAIL"));
+            sched_release(&sched, class);
+            return 0;
+        }
+
+        // pass the part down the chain, the replica is the end of it
+        if ((req[0][0] == 'C' || req[0][0] == 'S') && strcmp(req[3], "NULL")) {
+            if ((replicafd = replica_connect(req[3])) >= 0) {
+                sprintf(header, "RPUT %s %s NULL %lu", req[1], req[2], offset);
+                if (tls_send(replicafd, header, strlen(header)+1) < 0) {
+                    tls_close(replicafd);
+                    replicafd = -1;
+                }
             }
         }
+
+        // admitted and ready, a send that fails leaves the part short and it is answered PUT_FAIL below
+        if (req[0][0] == 'S') tls_send(clientfd, "GO", sizeof("GO"));
+
+        // the first read may already hold data after the header,
+        // the rest is read a whole TLS record at a time
+        char data_buf[TLS_CHUNK];
+        char* data = buf + strlen(buf) + 1;
+        n -= strlen(buf) + 1;
+        rec = offset + n;
+        while (1) {
+            forward(&replicafd, data, n);
+            fwrite(data, 1, n, file);
+            if (rec >= file_size) break;
+
+            // the replica leg comes from the primary, which already held the client to its limit,
+            // and keying it on the primary's address would put all replication in one bucket
+            if ((n = tls_recv(clientfd, data_buf, TLS_CHUNK)) <= 0) break;
+            if (req[0][0] != 'R') sched_throttle(&sched, class, client, n);
+            rec += n;
+            data = data_buf;
+        }
         fclose(file);
+
+        // a part longer than its header said is no good, drop it rather than commit it
+        if (rec > file_size) unlink(partial_name);
+        if (rec == file_size) {
+            if (rename(partial_name, file_name) < 0) rec = 0;
+            else remove_stale_partials(req[1]);
+        }
+
+        if (chain) {
+            // PUT_OK means every copy asked for is stored, PUT_LOCAL that the replica must be sent separately
+            char* ack = "PUT_OK";
+            if (rec != file_size) ack = "PUT_FAIL";
+            else if (strcmp(req[3], "NULL") && !replica_stored(replicafd)) ack = "PUT_LOCAL";
+            tls_send(clientfd, ack, strlen(ack)+1);
+        }
+        if (replicafd >= 0) tls_close(replicafd);
+        keep = rec == file_size;
+    } else if (!strncmp(req[0], "STAT", BUFFERSIZE)) {
+        // how much of a part is stored, STORED for a whole part, PARTIAL for what an interrupted put left
+        char file_name[BUFFERSIZE*2];
+        char reply[BUFFERSIZE];
+        struct stat st;
+
+        sprintf(file_name, "%s/%s", server_dir, req[1]);
+        if (stat(file_name, &st) == 0) {
+            sprintf(reply, "STORED %lu", (unsigned long)st.st_size);
+        } else {
+            sprintf(file_name, "%s/.%s", server_dir, req[1]);
+            if (stat(file_name, &st) == 0) sprintf(reply, "PARTIAL %lu", (unsigned long)st.st_size);
+            else strcpy(reply, "NONE");
+        }
+        if (tls_send(clientfd, reply, strlen(reply)+1) < 0) keep = 0;
     } else if (!strncmp(req[0], "GET", BUFFERSIZE)) {
         char filename[BUFFERSIZE*2];
         sprintf(filename, "%s/%s", server_dir, req[1]);
-        FILE* file = fopen(filename, "r");
+        FILE* file = fopen(filename, "re");
+
+        // the reply is the part size, the part and the end marker, or NONE for a missing part
+        if (!file) {
+            if (tls_send(clientfd, "NONE", sizeof("NONE")) < 0) keep = 0;
+        } else {
+            unsigned long file_size;
+            char size_buf[BUFFERSIZE];
+            fseek(file, 0, SEEK_END);
+            file_size = ftell(file);
+            fseek(file, 0, SEEK_SET);
+
+            // req[2] is where to start in the part, so a get cut short can fetch just the rest,
+            // and req[3], if given, how much of it to send, so a client can fetch a part a window at a time
+            off_t offset = strtoul(req[2], NULL, 10);
+            if (offset > file_size) offset = file_size;
+            if (strcmp(req[3], "NULL") && offset + strtoul(req[3], NULL, 10) < file_size)
+                file_size = offset + strtoul(req[3], NULL, 10);
+
+            // a failed send means the client cancelled the request, just drop the connection
+            sprintf(size_buf, "%lu", file_size - offset);
+            tls_send(clientfd, size_buf, strlen(size_buf)+1);
+            while (offset < file_size) {
+                unsigned long chunk = file_size - offset < SEND_CHUNK ? file_size - offset : SEND_CHUNK;
+                sched_throttle(&sched, class, client, chunk);
+                if (tls_sendfile(clientfd, fileno(file), &offset, chunk) <= 0) break;
+            }
+            if (offset < file_size || tls_send(clientfd, "END_SEND", sizeof("END_SEND")) < 0) keep = 0;
+            fclose(file);
+        }
+    } else {
+        keep = 0;
+    }
 
-        unsigned long file_size;
-        fseek(file, 0, SEEK_END);
-        file_size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        
-        off_t offset;
-        if (sendfile(args->clientfd, fileno(file), &offset, file_size) < 0) error("ERROR in sendfile");
-        if (send(args->clientfd, "END_SEND", sizeof("END_SEND"), 0) < 0) error("ERROR in send");
+    sched_release(&sched, class);
+    return keep;
+}
+
+int resolve_peer(char* peer, char* host, struct sockaddr_in* addr) {
+    struct addrinfo hints, *res;
+
+    // split host:port
+    int colon = strcspn(peer, ":");
+    if (peer[colon] == '\0' || colon >= BUFFERSIZE) return -1;
+    strncpy(host, peer, colon);
+    host[colon] = '\0';
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, peer+colon+1, &hints, &res) != 0) return -1;
+    memcpy(addr, res->ai_addr, sizeof(*addr));
+    freeaddrinfo(res);
+    return 0;
+}
+
+int replica_connect(char* next) {
+    char host[BUFFERSIZE];
+    struct sockaddr_in addr;
+    int known = 0;
+    int fd;
+
+    if (resolve_peer(next, host, &addr) < 0) return -1;
+    for (int i = 0; i < num_peers; i++)
+        if (peers[i].sin_addr.s_addr == addr.sin_addr.s_addr && peers[i].sin_port == addr.sin_port) known = 1;
+    if (!known) return -1;
+
+    // connect without blocking so a replica that is down costs the upload at most REPLICA_CONNECT_MS
+    // instead of a SYN timeout, then go back to blocking for the transfer
+    struct pollfd pfd = {0, POLLOUT, 0};
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) return -1;
+    pfd.fd = fd;
+    if ((connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 &&
+         (errno != EINPROGRESS || poll(&pfd, 1, REPLICA_CONNECT_MS) <= 0 ||
+          getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0)) ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0 ||
+        (tls_client && tls_connect(tls_client, fd, host, ntohs(addr.sin_port)) < 0)) {
+        tls_close(fd);
+        return -1;
     }
 
-    // socket no longer needed
-    close(args->clientfd);
+    // bound every send and the ack so a stalled replica can't hold the primary's bulk slot,
+    // forward drops it and the client is told PUT_LOCAL instead
+    struct timeval timeout = {REPLICA_TIMEOUT, 0};
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        tls_close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    // remove current thread from global array
-    array_get(args->arr, args->thread_id);
+void forward(int* replicafd, char* data, int len) {
+    if (*replicafd < 0) return;
 
-    // free memory alocated by malloc from main thread
-    free(args->thread_id);
-    free(args);
-    return NULL;
+    // a blocking send only comes back short when REPLICA_TIMEOUT ran out, which a replica that is
+    // trickling its window open would otherwise reset on every call
+    int n = tls_send(*replicafd, data, len);
+    if (n < len) {
+        tls_close(*replicafd);
+        *replicafd = -1;
+    }
+}
+
+int replica_stored(int replicafd) {
+    char ack[BUFFERSIZE] = {0};
+    if (replicafd < 0) return 0;
+    if (tls_recv(replicafd, ack, BUFFERSIZE-1) <= 0) return 0;
+    return !strcmp(ack, "PUT_OK");
+}
+
+void remove_stale_partials(char* part_name) {
+    struct dirent *de;
+    struct stat st;
+    char path[BUFFERSIZE*2];
+    DIR *dr;
+    time_t now = time(NULL);
+
+    // part names are <put time>:<part>:<name>, a partial is the same behind a dot
+    char* suffix = strchr(part_name, ':');
+    if (!suffix || !(dr = opendir(server_dir))) return;
+
+    while ((de = readdir(dr)) != NULL) {
+        char* name = de->d_name + 1;
+        if (de->d_name[0] != '.' || !strcmp(name, "") || !strcmp(name, ".")) continue;
+        sprintf(path, "%s/%s", server_dir, de->d_name);
+
+        // a put of the same part started before this one can't be resumed into anything current,
+        // a newer one may still be uploading and is left alone
+        char* tmp = strchr(name, ':');
+        int older = tmp && !strcmp(tmp, suffix) && tmp-name == suffix-part_name && strncmp(name, part_name, tmp-name) < 0;
+        if (older || (stat(path, &st) == 0 && now - st.st_mtime > PARTIAL_EXPIRY)) unlink(path);
+    }
+    closedir(dr);
+}
+
+int is_peer(in_addr_t addr) {
+    for (int i = 0; i < num_peers; i++)
+        if (peers[i].sin_addr.s_addr == addr) return 1;
+    return 0;
+}
+
+sched_class_t classify(char req[5][BUFFERSIZE/2]) {
+    if (!strncmp(req[0], "GET", BUFFERSIZE)) {
+        char filename[BUFFERSIZE*2];
+        struct stat st;
+        sprintf(filename, "%s/%s", server_dir, req[1]);
+        if (stat(filename, &st) < 0 || st.st_size <= SCHED_SMALL_READ) return CLASS_SMALL_READ;
+        if (strcmp(req[3], "NULL") && strtoul(req[3], NULL, 10) <= SCHED_SMALL_READ) return CLASS_SMALL_READ;
+        return CLASS_BULK;
+    }
+    if (!strncmp(req[0], "PUT", BUFFERSIZE) || !strncmp(req[0], "CPUT", BUFFERSIZE) || !strncmp(req[0], "SPUT", BUFFERSIZE))
+        return CLASS_BULK;
+    if (!strncmp(req[0], "RPUT", BUFFERSIZE)) return CLASS_REPLICA;
+    return CLASS_METADATA;
 }
\ No newline at end of file
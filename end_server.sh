@@ -1,4 +1,4 @@
-fuser -k 10001/tcp
-fuser -k 10002/tcp
-fuser -k 10003/tcp
-fuser -k 10004/tcp
\ No newline at end of file
+fuser -k -TERM 10001/tcp
+fuser -k -TERM 10002/tcp
+fuser -k -TERM 10003/tcp
+fuser -k -TERM 10004/tcp
\ No newline at end of file
@@ -0,0 +1,1623 @@
+#define _GNU_SOURCE // open_memstream
+
+#include "libdfc_private.h"
+#include "tls.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <openssl/md5.h>
+
+#define DIG_LEN 10
+#define PART_LEN 1
+#define END_LEN sizeof("END_SEND") // servers end a get reply with this marker, terminator included
+#define HEDGE_PERCENTILE 95 // hedge a part that is slower to answer than this percentile
+#define HEDGE_MIN_SAMPLES 8 // below this many samples hedge on a multiple of the rtt instead
+#define HEDGE_RTT_MULT 4
+#define HEDGE_MIN_MS 10.0
+#define EWMA_WEIGHT 0.25 // weight given to the newest rtt/throughput sample
+#define PUT_STORED 1 // put_part result: only the contacted server has the part
+#define PUT_CHAINED 2 // put_part result: the server and its chain replica have the part
+#define REPLY_BUSY -2 // request and recv_size result: the server turned the request away as busy
+#define BUSY_RETRIES 4 // times a busy server is retried, doubling the backoff each time
+#define BUSY_BACKOFF_MS 100
+#define JOURNAL_SUFFIX ".dfcj" // transfer journal kept beside the local file until a put or get completes
+#define LIST_TIMEOUT_MS 5000 // longest a list waits on a server, busy ones included
+#define LIST_MIN_GRACE_MS 100.0 // least time the other servers get to list once one has
+
+// states of a server's list
+#define LIST_PENDING 0
+#define LIST_BUSY 1 // backing off from a busy server, which is alive and waited on past the deadline
+#define LIST_DONE 2
+
+// operations run by the async calls
+#define JOB_LIST 0
+#define JOB_PUT 1
+#define JOB_GET 2
+
+// argument struct for run_job
+typedef struct {
+    dfc_t* dfc;
+    int op;
+    char name[BUFFERSIZE];
+    char path[BUFFERSIZE];
+    dfc_callback_t cb;
+    dfc_list_callback_t list_cb;
+    void* arg;
+} dfc_job_t;
+
+// one server's list, gathered on a thread of its own
+typedef struct {
+    struct list_round* round;
+    int server_num;
+    dfc_file_t* files;
+    int num_files;
+    int files_len;
+    int state;
+    int result; // of list_server, once LIST_DONE
+    int sock; // connection the list is being read from, -1 between requests
+} list_job_t;
+
+// the lists of one call, freed by whichever of the caller and the list threads is done with it last
+typedef struct list_round {
+    dfc_t* dfc;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed; // a list finished or started backing off
+    int refs;
+    int abandoned; // the caller stopped waiting, busy servers aren't asked again
+    list_job_t jobs[NUM_SERVERS];
+} list_round_t;
+
+// argument struct for fetch_window
+typedef struct {
+    dfc_handle_t* h;
+    dfc_window_t* w;
+} window_arg_t;
+
+// gets addresses and port numbers for each server, and the CA file if TLS is on
+static int get_server_data(char* conf_file, char addrs[NUM_SERVERS][BUFFERSIZE], int ports[NUM_SERVERS], char tls_ca[BUFFERSIZE]);
+
+// connects to a server, giving up after a second
+static int server_connect(int* server_socket, struct sockaddr_in* serveraddr);
+
+//parses the file name
+static int parse_filename(char* str, time_t* time, int* part, char filename[BUFFERSIZE]);
+
+// compares two instances of dfc_file_t, used in qsort
+static int compare_filestatus(const void *a, const void *b);
+
+// compares two doubles, used in qsort
+static int compare_double(const void *a, const void *b);
+
+// current wall clock time in milliseconds
+static double now_ms();
+
+// connects to a server and folds the connect time into its latency estimate, returns the socket, REPLY_BUSY or -1
+// a list connecting for job has the socket set during the handshake, so giving up on the list cuts that short too
+static int timed_connect(dfc_t* dfc, int server_num, list_job_t* job);
+
+// takes an idle connection to a server from the pool, or opens a new one for job, which may be NULL
+static int conn_get(dfc_t* dfc, int server_num, list_job_t* job);
+
+// returns a connection that finished its request cleanly to the pool
+static void conn_put(dfc_t* dfc, int server_num, int server_socket);
+
+// sends a request to a server, returns the socket, REPLY_BUSY if the server turned the connection away or -1
+static int request(dfc_t* dfc, int server_num, char* req);
+
+// adds the files one server lists to the job's files, returns 0, REPLY_BUSY or -1
+static int list_server(list_job_t* job);
+
+// sets the connection a list is being read from, cut short right away if the list was given up on
+static void list_sock(list_job_t* job, int server_socket);
+
+// the entry for one version of a file, added if it isn't there yet
+static dfc_file_t* file_entry(dfc_file_t** files, int* num_files, int* files_len, char* filename, time_t time);
+
+// lists every server at once, waiting on the slow ones only until the deadline unless name is given
+// and its newest version listed so far is missing a part
+static int list_all(dfc_t* dfc, char* name, dfc_file_t** files, int* num_files);
+
+// asks one server for its list, and again after a backoff while it is busy
+static void* list_thread(void* arg);
+
+// whether the newest version of name in files has every part
+static int list_complete(dfc_file_t* files, int num_files, char* name);
+
+// drops a reference to a round, freeing it with the last one
+static void list_round_put(list_round_t* round);
+
+// orders the servers in the holders bitmask from fastest to slowest expected reply
+static int rank_replicas(dfc_t* dfc, int holders, int replicas[NUM_SERVERS]);
+
+// how long to wait on a server's first byte before hedging the request
+static double hedge_threshold_ms(dfc_t* dfc, int server_num, int size_class);
+
+// waits up to timeout_ms (forever if negative) for one of the sockets to be readable, returns its index or -1
+static int wait_readable(int* socks, int num_socks, double timeout_ms);
+
+// records the first byte latency of a reply
+static void record_ttfb(dfc_t* dfc, int size_class, double ms);
+
+// records a completed part transfer against the server that sent it
+static void record_transfer(dfc_t* dfc, int server_num, unsigned long bytes, double ms);
+
+// reads the size that opens a get reply, returns 0, -1 if the reply was cut short or missing the part, or REPLY_BUSY
+static int recv_size(int server_socket, unsigned long* size);
+
+// writes the size bytes of a get reply after its size to file, returns -1 if the reply was cut short
+static int recv_part(int server_socket, unsigned long size, FILE* file, unsigned long* bytes);
+
+// notes a server that failed a get as busy, or down if it wasn't just busy
+static void reply_failed(dfc_t* dfc, int server_num, int result, int* busy);
+
+// fetches one part of a file, from done bytes in, from the fastest replica into file at its current position,
+// len bytes of it, or the rest of it if len is 0
+static int get_part(dfc_t* dfc, dfc_file_t* status, int file_part, FILE* file, unsigned long done, unsigned long len);
+
+// asks a server how much of a part it has in size, returns 1 if it is stored whole, 0 if not and -1 if it can't be asked
+static int stat_part(dfc_t* dfc, int server_num, char* part_name, unsigned long* size);
+
+// asks a server how much of a part it has, returns 1 if it holds the whole part, 0 if not and -1 if it can't be asked
+static int part_committed(dfc_t* dfc, int server_num, char* part_name, unsigned long len, unsigned long* done);
+
+// sends one part to a server, which forwards it to next ("NULL" for no replica), returns PUT_STORED, PUT_CHAINED or -1
+// the server already has the first done bytes, only the rest are sent
+static int put_part(dfc_t* dfc, int server_num, int fd, char* part_name, off_t offset, unsigned long len, unsigned long done, char* next);
+
+// sends a SPUT header and waits for the server to take the part before any of it is sent,
+// returns the socket, REPLY_BUSY or -1
+static int stream_put(dfc_t* dfc, int server_num, char* header);
+
+// the server the first part of name goes to, the other parts go to the servers after it in turn
+static int first_server(char* name);
+
+// stripes size bytes of fd over the servers as name at put_time, resuming whatever parts the servers already have
+static int put_fd(dfc_t* dfc, int fd, unsigned long file_size, char* name, time_t put_time, int resume);
+
+// path of the transfer journal for a local file
+static void journal_path(char* path, char journal[BUFFERSIZE*2]);
+
+// replaces the contents of a transfer journal
+static void journal_write(char* journal, char* fmt, ...);
+
+// finds the newest version of name, returns -1 if no server has it
+static int find_file(dfc_t* dfc, char* name, dfc_file_t* status);
+
+// multi-thread function behind the async calls
+static void* run_job(void* arg);
+
+// starts a job on its own detached thread
+static int start_job(dfc_job_t* job);
+
+// the window of a read handle holding offset, fetched unless it is already there or being read ahead,
+// returns NULL if it can't be fetched
+static dfc_window_t* load_window(dfc_handle_t* h, unsigned long offset);
+
+// starts fetching the window holding offset into the window of a read handle the reader isn't in
+static void read_ahead(dfc_handle_t* h, unsigned long offset);
+
+// points a window of a read handle at the bytes around offset, dropping what it held
+static void set_window(dfc_handle_t* h, dfc_window_t* w, unsigned long offset);
+
+// fetches a window of a read handle into memory, run directly or as read ahead
+static void* fetch_window(void* arg);
+
+// the part of a handle's file that holds offset
+static int part_of(dfc_handle_t* h, unsigned long offset);
+
+// where a part of a handle's file starts and ends
+static void part_range(dfc_handle_t* h, int part, unsigned long* start, unsigned long* end);
+
+// size of a part of the file a read handle is on, asked of the fastest server holding it, returns 0 or -1
+static int holder_size(dfc_handle_t* h, int part, unsigned long* size);
+
+// copies writes into a write handle's buffer, handing it to write_behind whenever it fills or a part ends
+static long write_parts(dfc_handle_t* h, const char* buf, unsigned long len);
+
+// sends the buffer a write handle filled on flush_thread once the one before it is sent, last if it ends its part
+static void write_behind(dfc_handle_t* h, int last);
+
+// sends a write handle's flush buffer, connecting for a new part first and reading the ack after its end
+static void* flush_buffer(void* arg);
+
+// waits for a write handle's flush_thread, if it is running
+static void flush_wait(dfc_handle_t* h);
+
+dfc_t* dfc_init(char* conf_file) {
+    char tls_ca[BUFFERSIZE] = {0};
+    dfc_t* dfc = calloc(1, sizeof(dfc_t));
+    if (dfc == NULL) return NULL;
+
+    if (get_server_data(conf_file, dfc->addrs, dfc->ports, tls_ca) < 0) {
+        free(dfc);
+        return NULL;
+    }
+
+    // resolve every server once so connections don't each pay for a lookup
+    for (int i = 0; i < NUM_SERVERS; i++) {
+        struct addrinfo hints, *res;
+        bzero(&hints, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(dfc->addrs[i], NULL, &hints, &res) != 0) {
+            fprintf(stderr,"ERROR, no such host as %s\n", dfc->addrs[i]);
+            free(dfc);
+            return NULL;
+        }
+        memcpy(&dfc->serveraddrs[i], res->ai_addr, sizeof(struct sockaddr_in));
+        dfc->serveraddrs[i].sin_port = htons(dfc->ports[i]);
+        freeaddrinfo(res);
+    }
+
+    if (tls_ca[0] && !(dfc->tls = tls_client_ctx(tls_ca))) {
+        fprintf(stderr, "ERROR, cannot load TLS CA %s\n", tls_ca);
+        free(dfc);
+        return NULL;
+    }
+
+    pthread_mutex_init(&dfc->mutex, NULL);
+    pthread_cond_init(&dfc->list_idle, NULL);
+    return dfc;
+}
+
+void dfc_free(dfc_t* dfc) {
+    // lists given up on are still using the connections and stats
+    pthread_mutex_lock(&dfc->mutex);
+      while (dfc->list_threads) pthread_cond_wait(&dfc->list_idle, &dfc->mutex);
+    pthread_mutex_unlock(&dfc->mutex);
+
+    for (int i = 0; i < NUM_SERVERS; i++)
+        for (int j = 0; j < dfc->pool_len[i]; j++) tls_close(dfc->pool[i][j]);
+    if (dfc->tls) SSL_CTX_free(dfc->tls);
+    pthread_cond_destroy(&dfc->list_idle);
+    pthread_mutex_destroy(&dfc->mutex);
+    free(dfc);
+}
+
+int  dfc_list(dfc_t* dfc, dfc_file_t** files, int* num_files) {
+    return list_all(dfc, NULL, files, num_files);
+}
+
+int  dfc_put(dfc_t* dfc, char* path, char* name) {
+    char journal[BUFFERSIZE*2];
+    struct stat st;
+    time_t put_time = time(NULL);
+    int resume = 0;
+
+    // attempt to open file
+    FILE* file = fopen(path, "r");
+    if (!file) return DFC_ERR_LOCAL;
+    if (fstat(fileno(file), &st) < 0) {
+        fclose(file);
+        return DFC_ERR_LOCAL;
+    }
+
+    // an unfinished put of the same unchanged file is picked up under its original time,
+    // so the parts the servers already have are not sent again
+    journal_path(path, journal);
+    FILE* j = fopen(journal, "r");
+    if (j) {
+        char j_name[BUFFERSIZE];
+        long j_time, j_mtime;
+        unsigned long j_size;
+        if (fscanf(j, "put %2047s %ld %lu %ld", j_name, &j_time, &j_size, &j_mtime) == 4 &&
+            !strcmp(j_name, name) && j_size == st.st_size && j_mtime == st.st_mtime) {
+            put_time = j_time;
+            resume = 1;
+        }
+        fclose(j);
+    }
+    if (!resume) journal_write(journal, "put %s %ld %lu %ld\n", name, (long)put_time, (unsigned long)st.st_size, (long)st.st_mtime);
+
+    int result = put_fd(dfc, fileno(file), st.st_size, name, put_time, resume);
+    fclose(file);
+    if (result == DFC_OK) unlink(journal);
+    return result;
+}
+
+int  dfc_get(dfc_t* dfc, char* name, char* path) {
+    dfc_file_t status;
+    if (find_file(dfc, name, &status) < 0) return DFC_ERR_NOT_FOUND;
+
+    if (status.parts[0] + status.parts[1] + status.parts[2] + status.parts[3] < 3) return DFC_ERR_INCOMPLETE;
+
+    // an unfinished get of the same version carries on from the part it reached,
+    // everything already in the local file past that part's start is kept
+    char journal[BUFFERSIZE*2];
+    FILE* file = NULL;
+    int first_part = 0;
+    unsigned long done = 0;
+    journal_path(path, journal);
+    FILE* j = fopen(journal, "r");
+    if (j) {
+        char j_name[BUFFERSIZE];
+        long j_time, j_start;
+        int j_part;
+        if (fscanf(j, "get %2047s %ld %d %ld", j_name, &j_time, &j_part, &j_start) == 4 &&
+            !strcmp(j_name, name) && j_time == status.time && j_part >= 0 && j_part < NUM_SERVERS &&
+            (file = fopen(path, "r+"))) {
+            fseek(file, 0, SEEK_END);
+            if (ftell(file) >= j_start) {
+                first_part = j_part;
+                done = ftell(file) - j_start;
+            } else {
+                fclose(file);
+                file = NULL;
+            }
+        }
+        fclose(j);
+    }
+
+    // file exists and has enough parts, get file
+    if (!file && !(file = fopen(path, "w"))) return DFC_ERR_LOCAL;
+
+    // get each file part from the fastest replica and write,
+    // the journal is moved on before each part once the parts before it are on disk
+    int result = DFC_OK;
+    for (int file_part = first_part; file_part < NUM_SERVERS && result == DFC_OK; file_part++) {
+        fflush(file);
+        journal_write(journal, "get %s %ld %d %ld\n", name, (long)status.time, file_part, ftell(file) - (long)done);
+        if (get_part(dfc, &status, file_part, file, done, 0) < 0) result = DFC_ERR_INCOMPLETE;
+        done = 0;
+    }
+
+    fclose(file);
+    if (result == DFC_OK) unlink(journal);
+    return result;
+}
+
+int  dfc_list_async(dfc_t* dfc, dfc_list_callback_t cb, void* arg) {
+    dfc_job_t* job = malloc(sizeof(dfc_job_t)); // freed by run_job
+    job->dfc = dfc;
+    job->op = JOB_LIST;
+    job->list_cb = cb;
+    job->arg = arg;
+    return start_job(job);
+}
+
+int  dfc_put_async(dfc_t* dfc, char* path, char* name, dfc_callback_t cb, void* arg) {
+    dfc_job_t* job = malloc(sizeof(dfc_job_t)); // freed by run_job
+    job->dfc = dfc;
+    job->op = JOB_PUT;
+    strncpy(job->path, path, BUFFERSIZE-1);
+    strncpy(job->name, name, BUFFERSIZE-1);
+    job->cb = cb;
+    job->arg = arg;
+    return start_job(job);
+}
+
+int  dfc_get_async(dfc_t* dfc, char* name, char* path, dfc_callback_t cb, void* arg) {
+    dfc_job_t* job = malloc(sizeof(dfc_job_t)); // freed by run_job
+    job->dfc = dfc;
+    job->op = JOB_GET;
+    strncpy(job->path, path, BUFFERSIZE-1);
+    strncpy(job->name, name, BUFFERSIZE-1);
+    job->cb = cb;
+    job->arg = arg;
+    return start_job(job);
+}
+
+dfc_handle_t* dfc_open(dfc_t* dfc, char* name, int mode, unsigned long size) {
+    if (mode != 'r' && mode != 'w') return NULL;
+
+    dfc_handle_t* h = calloc(1, sizeof(dfc_handle_t));
+    h->dfc = dfc;
+    h->mode = mode;
+    h->sock = -1;
+    strncpy(h->name, name, BUFFERSIZE-1);
+
+    if (mode == 'w') {
+        // parts are cut from the size given up front, so each can be sent as it is written
+        h->size = size;
+        h->part_len = size / NUM_SERVERS;
+        h->put_time = time(NULL);
+        h->bufs[0] = malloc(DFC_WINDOW);
+        h->bufs[1] = malloc(DFC_WINDOW);
+        if (!h->bufs[0] || !h->bufs[1]) {
+            free(h->bufs[0]);
+            free(h->bufs[1]);
+            free(h);
+            return NULL;
+        }
+
+        // empty parts, of a file smaller than NUM_SERVERS bytes, are stored right away
+        write_parts(h, NULL, 0);
+        return h;
+    }
+
+    // every part but the last is the size of the first, the last holds the rest
+    unsigned long first, last;
+    if (find_file(dfc, name, &h->status) < 0 || holder_size(h, 0, &first) < 0 || holder_size(h, NUM_SERVERS-1, &last) < 0) {
+        dfc_close(h);
+        return NULL;
+    }
+    h->part_len = first;
+    h->size = (NUM_SERVERS-1)*first + last;
+    return h;
+}
+
+long dfc_read(dfc_handle_t* h, void* buf, unsigned long len) {
+    unsigned long total = 0;
+    if (h->mode != 'r') return -1;
+
+    while (total < len && h->pos < h->size) {
+        dfc_window_t* w = load_window(h, h->pos);
+        if (!w) return total ? (long)total : -1;
+
+        // read ahead the next window while this one is consumed
+        read_ahead(h, w->end);
+
+        // a part shorter than its size said ends the file early
+        if (h->pos >= w->start + w->len) break;
+
+        unsigned long n = w->start + w->len - h->pos;
+        if (n > len - total) n = len - total;
+        memcpy((char*)buf + total, w->data + (h->pos - w->start), n);
+        total += n;
+        h->pos += n;
+    }
+
+    return total;
+}
+
+long dfc_write(dfc_handle_t* h, const void* buf, unsigned long len) {
+    if (h->mode != 'w') return -1;
+    if (h->pos == h->size && len) return -1;
+
+    return write_parts(h, buf, len);
+}
+
+long dfc_seek(dfc_handle_t* h, long offset, int whence) {
+    long base = 0;
+
+    if (whence == SEEK_CUR) base = h->pos;
+    else if (whence == SEEK_END) base = h->size;
+    else if (whence != SEEK_SET) return -1;
+
+    // a write handle's parts are sent as they fill, so it only ever writes in order
+    if (base + offset < 0 || (h->mode == 'w' && base + offset != h->pos)) return -1;
+    h->pos = base + offset;
+    return h->pos;
+}
+
+int  dfc_close(dfc_handle_t* h) {
+    int result = DFC_OK;
+
+    if (h->mode == 'w') {
+        // the last buffer went out when the last part ended, a handle closed early leaves its part short
+        flush_wait(h);
+        if (h->sock >= 0) tls_close(h->sock);
+        result = h->pos == h->size ? h->result : DFC_ERR_INCOMPLETE;
+        free(h->bufs[0]);
+        free(h->bufs[1]);
+    } else {
+        for (int i = 0; i < 2; i++) {
+            if (h->windows[i].state == WINDOW_LOADING) pthread_join(h->windows[i].thread, NULL);
+            free(h->windows[i].data);
+        }
+    }
+
+    free(h);
+    return result;
+}
+
+static int get_server_data(char* conf_file, char addrs[NUM_SERVERS][BUFFERSIZE], int ports[NUM_SERVERS], char tls_ca[BUFFERSIZE]) {
+    // open conf file
+    FILE* conf;
+    if (!(conf = fopen(conf_file, "r"))) return -1;
+
+    char buf[BUFFERSIZE];
+    int server_num = 0;
+    while (fgets(buf, BUFFERSIZE, conf)) {
+        char* tmp;
+
+        // "tls <ca file>" turns on TLS, the servers' certificates must be signed by the CA
+        if (!strncmp(buf, "tls ", strlen("tls "))) {
+            if ((tmp = strtok(buf+strlen("tls "), " \n"))) strncpy(tls_ca, tmp, BUFFERSIZE-1);
+            continue;
+        }
+        if (server_num == NUM_SERVERS) continue;
+
+        for (int i = 0; i < 3; i++) {
+            if (i == 0) tmp = strtok(buf, " ");
+            else tmp = strtok(NULL, " ");
+            if (!tmp) break;
+
+            if (i == 2) {
+                int colon = strcspn(tmp, ":");
+                strncpy(addrs[server_num], tmp, colon);
+                addrs[server_num][colon] = '\0';
+                ports[server_num] = atoi(tmp+colon+1);
+            }
+        }
+        server_num++;
+    }
+
+    fclose(conf);
+    return 0;
+}
+
+static int server_connect(int* server_socket, struct sockaddr_in* serveraddr) {
+    int flags, result;
+    fd_set fdset;
+    struct timeval timeout;
+
+    if ((*server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return -1;
+
+    if ((flags = fcntl(*server_socket, F_GETFL, 0)) < 0 || fcntl(*server_socket, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+
+    result = connect(*server_socket, (struct sockaddr *)serveraddr, sizeof(*serveraddr));
+
+    if (result != 0) {
+        FD_ZERO(&fdset);
+        FD_SET(*server_socket, &fdset);
+        timeout.tv_sec = 1; // one second timeout for sockets
+        timeout.tv_usec = 0;
+
+        result = select(*server_socket + 1, NULL, &fdset, NULL, &timeout);
+        if (result == 0) {
+            errno = ETIMEDOUT; // Set errno to indicate timeout
+            return -1;
+        } else if (result < 0) {
+            return -1;
+        }
+
+        // Check for connection success or failure
+        int err;
+        socklen_t len = sizeof(err);
+        if (getsockopt(*server_socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            errno = err;
+            return -1;
+        }
+    }
+
+    // Restore the socket to blocking mode
+    if (fcntl(*server_socket, F_SETFL, flags) < 0) return -1;
+
+    return 0;
+}
+
+static int parse_filename(char* str, time_t* time, int* part, char filename[BUFFERSIZE]) {
+    *time = strtol(str, NULL, 10);
+    *part = atoi(str+DIG_LEN+1);
+    strncpy(filename, str+DIG_LEN+PART_LEN+2, BUFFERSIZE);
+    return 0;
+}
+
+static int compare_filestatus(const void *a, const void *b) {
+    dfc_file_t* one = (dfc_file_t*) a;
+    dfc_file_t* two = (dfc_file_t*) b;
+
+    int n = strncmp(one->filename, two->filename, BUFFERSIZE);
+
+    if (n == 0) { // if they're the same file, compare times
+        n = one->time - two->time;
+        if (n > 0) two->disp = 0; else one->disp = 0;
+        return n;
+    } else {
+        return n;
+    }
+}
+
+static int compare_double(const void *a, const void *b) {
+    double one = *(double*) a;
+    double two = *(double*) b;
+    return (one > two) - (one < two);
+}
+
+static double now_ms() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static int timed_connect(dfc_t* dfc, int server_num, list_job_t* job) {
+    int server_socket;
+    double start = now_ms();
+    int result = server_connect(&server_socket, &dfc->serveraddrs[server_num]);
+    double rtt = now_ms() - start;
+
+    // the handshake is left out of the rtt, after the first one with a server it is resumed and cheap,
+    // and a server that hangs up during it has no thread to spare, which is busy rather than down
+    if (result == 0 && dfc->tls) {
+        if (job) list_sock(job, server_socket);
+        if ((result = tls_connect(dfc->tls, server_socket, dfc->addrs[server_num], dfc->ports[server_num])) < 0)
+            result = result == TLS_CLOSED ? REPLY_BUSY : -1;
+        if (job) list_sock(job, -1);
+    }
+
+    pthread_mutex_lock(&dfc->mutex);
+      server_stats_t* stats = &dfc->stats[server_num];
+      if (result == -1) {
+        stats->down = 1;
+      } else if (result == 0) {
+        stats->rtt_ms = stats->rtt_ms ? (1-EWMA_WEIGHT)*stats->rtt_ms + EWMA_WEIGHT*rtt : rtt;
+        stats->down = 0;
+      }
+    pthread_mutex_unlock(&dfc->mutex);
+
+    if (result < 0) {
+        if (server_socket >= 0) tls_close(server_socket);
+        return result;
+    }
+    return server_socket;
+}
+
+static int conn_get(dfc_t* dfc, int server_num, list_job_t* job) {
+    while (1) {
+        int server_socket = -1;
+        pthread_mutex_lock(&dfc->mutex);
+          if (dfc->pool_len[server_num]) server_socket = dfc->pool[server_num][--dfc->pool_len[server_num]];
+        pthread_mutex_unlock(&dfc->mutex);
+        if (server_socket < 0) return timed_connect(dfc, server_num, job);
+
+        // an idle connection with something to read has been closed by the server
+        struct pollfd pfd = {server_socket, POLLIN, 0};
+        if (poll(&pfd, 1, 0) == 0) return server_socket;
+        tls_close(server_socket);
+    }
+}
+
+static void conn_put(dfc_t* dfc, int server_num, int server_socket) {
+    pthread_mutex_lock(&dfc->mutex);
+      if (dfc->pool_len[server_num] < POOL_SIZE) {
+        dfc->pool[server_num][dfc->pool_len[server_num]++] = server_socket;
+        server_socket = -1;
+      }
+    pthread_mutex_unlock(&dfc->mutex);
+    if (server_socket >= 0) tls_close(server_socket);
+}
+
+static int request(dfc_t* dfc, int server_num, char* req) {
+    int server_socket;
+    if ((server_socket = conn_get(dfc, server_num, NULL)) < 0) return server_socket;
+    if (tls_send(server_socket, req, strlen(req)+1) < 0) {
+        tls_close(server_socket);
+        return -1;
+    }
+    return server_socket;
+}
+
+static int list_server(list_job_t* job) {
+    dfc_t* dfc = job->round->dfc;
+    int server_num = job->server_num;
+    char buf[BUFFERSIZE*2];
+    int held = 0; // bytes of a name not yet terminated
+    int busy = 0;
+    int server_socket;
+    int n;
+
+    if ((server_socket = conn_get(dfc, server_num, job)) < 0) return server_socket;
+    list_sock(job, server_socket);
+    if (tls_send(server_socket, "LIST NULL NULL", sizeof("LIST NULL NULL")) < 0) {
+        list_sock(job, -1);
+        tls_close(server_socket);
+        return -1;
+    }
+
+    while ((n = tls_recv(server_socket, buf+held, BUFFERSIZE)) > 0) {
+        char* line = buf;
+        char* nul;
+        held += n;
+
+        // handle every name that has fully arrived
+        while ((nul = memchr(line, '\0', buf+held-line))) {
+            char filename[BUFFERSIZE];
+            int part;
+            time_t time;
+
+            if (!strcmp(line, "END_SEND")) {
+                list_sock(job, -1);
+                conn_put(dfc, server_num, server_socket);
+                return 0;
+            }
+            if (!strcmp(line, "BUSY")) {
+                busy = 1;
+                break;
+            }
+
+            parse_filename(line, &time, &part, filename);
+            line = nul + 1;
+            if (part < 1 || part > NUM_SERVERS) continue; // not a file part
+
+            dfc_file_t* entry = file_entry(&job->files, &job->num_files, &job->files_len, filename, time);
+            entry->parts[part-1] = 1;
+            entry->holders[part-1] |= 1 << server_num;
+        }
+        if (busy) break;
+
+        // keep the start of a name cut off by the end of the read
+        held = buf+held-line;
+        memmove(buf, line, held);
+        if (held >= BUFFERSIZE) break;
+    }
+
+    // server went away or is too busy to list
+    list_sock(job, -1);
+    tls_close(server_socket);
+    return busy ? REPLY_BUSY : -1;
+}
+
+static void list_sock(list_job_t* job, int server_socket) {
+    pthread_mutex_lock(&job->round->mutex);
+      job->sock = server_socket;
+      if (server_socket >= 0 && job->round->abandoned) shutdown(server_socket, SHUT_RDWR);
+    pthread_mutex_unlock(&job->round->mutex);
+}
+
+static dfc_file_t* file_entry(dfc_file_t** files, int* num_files, int* files_len, char* filename, time_t time) {
+    int i;
+    for (i = 0; i < *num_files; i++)
+        if (!strncmp(filename, (*files)[i].filename, BUFFERSIZE) && time == (*files)[i].time) return &(*files)[i];
+
+    // file doesn't exist in array
+    if (*files_len == *num_files) {
+        *files = realloc(*files, *files_len*2*sizeof(dfc_file_t));
+        *files_len *= 2;
+    }
+
+    bzero(&(*files)[i], sizeof(dfc_file_t));
+    strncpy((*files)[i].filename, filename, BUFFERSIZE);
+    (*files)[i].disp = 1;
+    (*files)[i].time = time;
+    (*num_files)++;
+    return &(*files)[i];
+}
+
+static int list_all(dfc_t* dfc, char* name, dfc_file_t** files, int* num_files) {
+    int files_len = 1;
+    *files = malloc(sizeof(dfc_file_t));
+    *num_files = 0;
+
+    list_round_t* round = calloc(1, sizeof(list_round_t));
+    if (!round) return DFC_ERR_LOCAL;
+    round->dfc = dfc;
+    round->refs = 1;
+    pthread_mutex_init(&round->mutex, NULL);
+    pthread_cond_init(&round->changed, NULL);
+
+    // ask every server at once, the connect times here also seed each server's latency estimate
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int server_num = 0; server_num < NUM_SERVERS; server_num++) {
+        list_job_t* job = &round->jobs[server_num];
+        pthread_t thread_id;
+        job->round = round;
+        job->server_num = server_num;
+        job->files = malloc(sizeof(dfc_file_t));
+        job->files_len = 1;
+        job->sock = -1;
+
+        pthread_mutex_lock(&dfc->mutex);
+          dfc->list_threads++;
+        pthread_mutex_unlock(&dfc->mutex);
+        pthread_mutex_lock(&round->mutex);
+          round->refs++;
+        pthread_mutex_unlock(&round->mutex);
+        if (pthread_create(&thread_id, &attr, list_thread, job) != 0) {
+            pthread_mutex_lock(&round->mutex);
+              round->refs--;
+              job->result = -1;
+              job->state = LIST_DONE;
+            pthread_mutex_unlock(&round->mutex);
+            pthread_mutex_lock(&dfc->mutex);
+              dfc->list_threads--;
+            pthread_mutex_unlock(&dfc->mutex);
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    // once one server has listed the others get about as long as a reply usually takes on top,
+    // a server still silent after that is left behind and ranked last until it answers again,
+    // one that is only busy is still waited on, and so is any when the file asked for is missing a part
+    double start = now_ms();
+    double deadline = start + LIST_TIMEOUT_MS;
+    int merged[NUM_SERVERS] = {0};
+    int answered = 0;
+    int graced = 0;
+    pthread_mutex_lock(&round->mutex);
+      while (1) {
+        int pending = 0;
+        int busy = 0;
+        for (int i = 0; i < NUM_SERVERS; i++) {
+          list_job_t* job = &round->jobs[i];
+          if (job->state != LIST_DONE) {
+            pending |= 1 << i;
+            busy |= job->state == LIST_BUSY;
+          } else if (!merged[i]) {
+            merged[i] = 1;
+            answered |= job->result == 0;
+            for (int j = 0; j < job->num_files; j++) {
+              dfc_file_t* entry = file_entry(files, num_files, &files_len, job->files[j].filename, job->files[j].time);
+              for (int part = 0; part < NUM_SERVERS; part++) {
+                entry->parts[part] |= job->files[j].parts[part];
+                entry->holders[part] |= job->files[j].holders[part];
+              }
+            }
+          }
+        }
+        if (!pending) break;
+
+        if (answered && !graced) {
+          graced = 1;
+          double grace = LIST_MIN_GRACE_MS;
+          for (int i = 0; i < NUM_SERVERS; i++) {
+            double threshold = (pending & (1 << i)) ? hedge_threshold_ms(dfc, i, LATENCY_PART) : 0;
+            if (threshold > grace) grace = threshold;
+          }
+          if (now_ms() + grace < deadline) deadline = now_ms() + grace;
+        }
+
+        double now = now_ms();
+        if (now >= start + LIST_TIMEOUT_MS) break;
+        if (now >= deadline && !busy && (!name || list_complete(*files, *num_files, name))) break;
+
+        double until = now < deadline ? deadline : start + LIST_TIMEOUT_MS;
+        struct timespec wake;
+        wake.tv_sec = (time_t)(until / 1000);
+        wake.tv_nsec = (long)((until - wake.tv_sec * 1000.0) * 1e6);
+        pthread_cond_timedwait(&round->changed, &round->mutex, &wake);
+      }
+
+      // lists still being read are cut short, the threads reading them would otherwise hold up dfc_free
+      round->abandoned = 1;
+      for (int i = 0; i < NUM_SERVERS; i++) {
+        if (round->jobs[i].sock >= 0) shutdown(round->jobs[i].sock, SHUT_RDWR);
+        if (round->jobs[i].state != LIST_PENDING) continue;
+        pthread_mutex_lock(&dfc->mutex);
+          dfc->stats[i].down = 1;
+        pthread_mutex_unlock(&dfc->mutex);
+      }
+    pthread_mutex_unlock(&round->mutex);
+    list_round_put(round);
+
+    // sort, marking older versions of each file as hidden
+    qsort(*files, *num_files, sizeof(dfc_file_t), compare_filestatus);
+    return DFC_OK;
+}
+
+static void* list_thread(void* arg) {
+    list_job_t* job = (list_job_t*) arg;
+    list_round_t* round = job->round;
+    dfc_t* dfc = round->dfc;
+
+    // ask busy servers again after a backoff, skipping them would make their parts look missing
+    int result = list_server(job);
+    for (int attempt = 0; result == REPLY_BUSY && attempt < BUSY_RETRIES; attempt++) {
+        pthread_mutex_lock(&round->mutex);
+          int abandoned = round->abandoned;
+          job->state = LIST_BUSY;
+          pthread_cond_signal(&round->changed);
+        pthread_mutex_unlock(&round->mutex);
+        if (abandoned) break;
+
+        usleep((BUSY_BACKOFF_MS * 1000) << attempt);
+        result = list_server(job);
+    }
+
+    pthread_mutex_lock(&round->mutex);
+      job->result = result;
+      job->state = LIST_DONE;
+      pthread_cond_signal(&round->changed);
+    pthread_mutex_unlock(&round->mutex);
+    list_round_put(round);
+
+    // the last thing touching dfc, dfc_free may go ahead after this
+    pthread_mutex_lock(&dfc->mutex);
+      if (--dfc->list_threads == 0) pthread_cond_broadcast(&dfc->list_idle);
+    pthread_mutex_unlock(&dfc->mutex);
+    return NULL;
+}
+
+static int list_complete(dfc_file_t* files, int num_files, char* name) {
+    dfc_file_t* newest = NULL;
+    for (int i = 0; i < num_files; i++)
+        if (!strncmp(files[i].filename, name, BUFFERSIZE) && (!newest || files[i].time > newest->time)) newest = &files[i];
+    if (!newest) return 0;
+
+    for (int part = 0; part < NUM_SERVERS; part++) if (!newest->parts[part]) return 0;
+    return 1;
+}
+
+static void list_round_put(list_round_t* round) {
+    pthread_mutex_lock(&round->mutex);
+      int last = --round->refs == 0;
+    pthread_mutex_unlock(&round->mutex);
+    if (!last) return;
+
+    for (int i = 0; i < NUM_SERVERS; i++) free(round->jobs[i].files);
+    pthread_cond_destroy(&round->changed);
+    pthread_mutex_destroy(&round->mutex);
+    free(round);
+}
+
+static int rank_replicas(dfc_t* dfc, int holders, int replicas[NUM_SERVERS]) {
+    double cost[NUM_SERVERS];
+    int num_replicas = 0;
+
+    pthread_mutex_lock(&dfc->mutex);
+    for (int i = 0; i < NUM_SERVERS; i++) {
+        if (!(holders & (1 << i))) continue;
+
+        // expected time is the connect time plus the last part size over the server's throughput,
+        // servers that failed recently are only tried once the others are exhausted
+        server_stats_t* stats = &dfc->stats[i];
+        double c = stats->rtt_ms;
+        if (stats->bytes_per_ms > 0) c += dfc->last_part_bytes / stats->bytes_per_ms;
+        if (stats->down) c += 1e9;
+
+        // insertion sort, there are at most NUM_SERVERS entries
+        int j = num_replicas++;
+        for (; j > 0 && cost[j-1] > c; j--) {
+            cost[j] = cost[j-1];
+            replicas[j] = replicas[j-1];
+        }
+        cost[j] = c;
+        replicas[j] = i;
+    }
+    pthread_mutex_unlock(&dfc->mutex);
+
+    return num_replicas;
+}
+
+static double hedge_threshold_ms(dfc_t* dfc, int server_num, int size_class) {
+    double sorted[LATENCY_SAMPLES];
+    double threshold;
+
+    pthread_mutex_lock(&dfc->mutex);
+    int n = dfc->num_ttfb_samples[size_class] < LATENCY_SAMPLES ? dfc->num_ttfb_samples[size_class] : LATENCY_SAMPLES;
+    if (n < HEDGE_MIN_SAMPLES) {
+        threshold = HEDGE_RTT_MULT * dfc->stats[server_num].rtt_ms;
+        n = 0;
+    } else {
+        memcpy(sorted, dfc->ttfb_samples[size_class], n * sizeof(double));
+    }
+    pthread_mutex_unlock(&dfc->mutex);
+
+    if (n) {
+        qsort(sorted, n, sizeof(double), compare_double);
+        threshold = sorted[(n-1) * HEDGE_PERCENTILE / 100];
+    }
+    return threshold > HEDGE_MIN_MS ? threshold : HEDGE_MIN_MS;
+}
+
+static int wait_readable(int* socks, int num_socks, double timeout_ms) {
+    fd_set fdset;
+    struct timeval timeout;
+    int maxfd = -1;
+
+    // a reply TLS has already decrypted won't show up in select
+    for (int i = 0; i < num_socks; i++) if (tls_pending(socks[i])) return i;
+
+    FD_ZERO(&fdset);
+    for (int i = 0; i < num_socks; i++) {
+        FD_SET(socks[i], &fdset);
+        if (socks[i] > maxfd) maxfd = socks[i];
+    }
+
+    timeout.tv_sec = (long)timeout_ms / 1000;
+    timeout.tv_usec = ((long)(timeout_ms * 1000)) % 1000000;
+
+    if (select(maxfd + 1, &fdset, NULL, NULL, timeout_ms < 0 ? NULL : &timeout) <= 0) return -1;
+
+    for (int i = 0; i < num_socks; i++) if (FD_ISSET(socks[i], &fdset)) return i;
+    return -1;
+}
+
+static void record_ttfb(dfc_t* dfc, int size_class, double ms) {
+    pthread_mutex_lock(&dfc->mutex);
+      dfc->ttfb_samples[size_class][dfc->num_ttfb_samples[size_class]++ % LATENCY_SAMPLES] = ms;
+    pthread_mutex_unlock(&dfc->mutex);
+}
+
+static void record_transfer(dfc_t* dfc, int server_num, unsigned long bytes, double ms) {
+    pthread_mutex_lock(&dfc->mutex);
+      server_stats_t* stats = &dfc->stats[server_num];
+      dfc->last_part_bytes = bytes;
+
+      // parts too small to time say nothing about throughput
+      if (ms > 0) {
+        double rate = bytes / ms;
+        stats->bytes_per_ms = stats->bytes_per_ms ? (1-EWMA_WEIGHT)*stats->bytes_per_ms + EWMA_WEIGHT*rate : rate;
+      }
+    pthread_mutex_unlock(&dfc->mutex);
+}
+
+static int recv_size(int server_socket, unsigned long* size) {
+    char buf[BUFFERSIZE];
+    int len = 0;
+
+    // the reply opens with the part size, or BUSY/NONE
+    do {
+        if (tls_recv(server_socket, buf+len, 1) <= 0) return -1;
+    } while (buf[len++] != '\0' && len < BUFFERSIZE);
+    if (buf[len-1] != '\0') return -1;
+    if (!strcmp(buf, "BUSY")) return REPLY_BUSY;
+
+    char* end;
+    *size = strtoul(buf, &end, 10);
+    if (end == buf || *end) return -1;
+    return 0;
+}
+
+static int recv_part(int server_socket, unsigned long size, FILE* file, unsigned long* bytes) {
+    char buf[BUFFERSIZE];
+    int len;
+    int n;
+
+    // exactly size bytes follow the size, so the connection can be reused afterwards
+    // reading a whole TLS record at a time saves splitting each one over several reads
+    char data[TLS_CHUNK];
+    *bytes = 0;
+    while (*bytes < size) {
+        unsigned long want = size - *bytes < TLS_CHUNK ? size - *bytes : TLS_CHUNK;
+        if ((n = tls_recv(server_socket, data, want)) <= 0) return -1;
+        fwrite(data, 1, n, file);
+        *bytes += n;
+    }
+
+    // and the end marker
+    for (len = 0; len < END_LEN; len += n)
+        if ((n = tls_recv(server_socket, buf+len, END_LEN-len)) <= 0) return -1;
+    if (memcmp(buf, "END_SEND", END_LEN)) return -1;
+    return 0;
+}
+
+static int get_part(dfc_t* dfc, dfc_file_t* status, int file_part, FILE* file, unsigned long done, unsigned long len) {
+    unsigned long end = done + len;
+    int replicas[NUM_SERVERS];
+    int num_replicas = rank_replicas(dfc, status->holders[file_part], replicas);
+    char file_name[BUFFERSIZE*2];
+    int size_class = len ? LATENCY_WINDOW : LATENCY_PART;
+
+    // fall through the replicas until one delivers the whole part,
+    // starting over after a backoff if they were only busy
+    int next = 0;
+    int busy = 0;
+    int busy_retries = 0;
+    while (1) {
+        int socks[2];
+        int sock_server[2];
+        double sent[2];
+        int num_socks = 0;
+        int primary = 0; // the request hedged on, whose latency is the sample, -1 once it failed
+
+        if (next == num_replicas) {
+            if (!busy || busy_retries == BUSY_RETRIES) return -1;
+            usleep((BUSY_BACKOFF_MS * 1000) << busy_retries++);
+            next = 0;
+            busy = 0;
+        }
+
+        // every replica holds the same bytes, so each attempt picks up where the last one was cut off
+        if (len) sprintf(file_name, "GET %.10ld:%d:%s %lu %lu", status->time, file_part+1, status->filename, done, end-done);
+        else sprintf(file_name, "GET %.10ld:%d:%s %lu", status->time, file_part+1, status->filename, done);
+
+        // send get request to the fastest replica that accepts a connection
+        while (num_socks == 0 && next < num_replicas) {
+            sock_server[0] = replicas[next++];
+            if ((socks[0] = request(dfc, sock_server[0], file_name)) >= 0) {
+                sent[0] = now_ms();
+                num_socks = 1;
+            } else if (socks[0] == REPLY_BUSY) {
+                busy = 1;
+            }
+        }
+        if (num_socks == 0) continue;
+
+        // if the reply is later than usual, hedge the request on the next replica
+        int winner = wait_readable(socks, 1, hedge_threshold_ms(dfc, sock_server[0], size_class));
+        if (winner < 0) {
+            while (num_socks == 1 && next < num_replicas) {
+                sock_server[1] = replicas[next++];
+                if ((socks[1] = request(dfc, sock_server[1], file_name)) >= 0) {
+                    sent[1] = now_ms();
+                    num_socks = 2;
+                } else if (socks[1] == REPLY_BUSY) {
+                    busy = 1;
+                }
+            }
+            winner = wait_readable(socks, num_socks, -1);
+        }
+        if (winner < 0) {
+            for (int i = 0; i < num_socks; i++) tls_close(socks[i]);
+            continue;
+        }
+
+        // the first reply only wins once it turns out to be the part, a busy server or one
+        // without the part hands the race to the other request, which is still going
+        unsigned long size;
+        int received;
+        while ((received = recv_size(socks[winner], &size)) < 0 && num_socks == 2) {
+            reply_failed(dfc, sock_server[winner], received, &busy);
+            tls_close(socks[winner]);
+            primary = winner == primary ? -1 : 0;
+            socks[0] = socks[!winner];
+            sock_server[0] = sock_server[!winner];
+            sent[0] = sent[!winner];
+            num_socks = 1;
+            winner = 0;
+        }
+
+        // cancel whichever request lost the race, then get file part from server and write to local instance
+        // the sample is the primary's latency, only known to be at least this long if the hedge beat it,
+        // leaving out the slow ones the hedge saved us from would keep lowering the threshold
+        if (received == 0) {
+            if (num_socks == 2) tls_close(socks[!winner]);
+            double first_byte = now_ms();
+            if (primary >= 0) record_ttfb(dfc, size_class, first_byte - sent[primary]);
+
+            unsigned long part_bytes = 0;
+            received = recv_part(socks[winner], size, file, &part_bytes);
+            done += part_bytes;
+            if (received == 0) {
+                record_transfer(dfc, sock_server[winner], part_bytes, now_ms() - first_byte);
+                conn_put(dfc, sock_server[winner], socks[winner]);
+                return 0;
+            }
+        }
+
+        tls_close(socks[winner]);
+        reply_failed(dfc, sock_server[winner], received, &busy);
+    }
+}
+
+static void reply_failed(dfc_t* dfc, int server_num, int result, int* busy) {
+    if (result == REPLY_BUSY) {
+        *busy = 1;
+        return;
+    }
+    pthread_mutex_lock(&dfc->mutex);
+      dfc->stats[server_num].down = 1;
+    pthread_mutex_unlock(&dfc->mutex);
+}
+
+static int stat_part(dfc_t* dfc, int server_num, char* part_name, unsigned long* size) {
+    char req[BUFFERSIZE*4];
+    char reply[BUFFERSIZE] = {0};
+    int reply_len = 0;
+    int server_socket;
+
+    *size = 0;
+    sprintf(req, "STAT %s NULL", part_name);
+    if ((server_socket = request(dfc, server_num, req)) < 0) return -1;
+
+    do {
+        if (tls_recv(server_socket, reply+reply_len, 1) <= 0) {
+            tls_close(server_socket);
+            return -1;
+        }
+    } while (reply[reply_len++] != '\0' && reply_len < BUFFERSIZE-1);
+    conn_put(dfc, server_num, server_socket);
+
+    if (!strncmp(reply, "STORED ", strlen("STORED "))) {
+        *size = strtoul(reply+strlen("STORED "), NULL, 10);
+        return 1;
+    }
+    if (!strncmp(reply, "PARTIAL ", strlen("PARTIAL "))) *size = strtoul(reply+strlen("PARTIAL "), NULL, 10);
+    return 0;
+}
+
+static int part_committed(dfc_t* dfc, int server_num, char* part_name, unsigned long len, unsigned long* done) {
+    unsigned long size;
+    int stored = stat_part(dfc, server_num, part_name, &size);
+
+    // a partial part longer than the part belongs to some other put, start it over
+    *done = 0;
+    if (stored == 1 && size == len) {
+        *done = len;
+        return 1;
+    }
+    if (stored == 0 && size <= len) *done = size;
+    return stored < 0 ? -1 : 0;
+}
+
+static int put_part(dfc_t* dfc, int server_num, int fd, char* part_name, off_t offset, unsigned long len, unsigned long done, char* next) {
+    char header[BUFFERSIZE*4];
+    off_t end = offset + len;
+
+    // a busy server may cut the upload short or answer BUSY, either way back off and try again
+    for (int attempt = 0; attempt <= BUSY_RETRIES; attempt++) {
+        int server_socket;
+        char ack[BUFFERSIZE] = {0};
+
+        if (attempt) {
+            usleep((BUSY_BACKOFF_MS * 1000) << (attempt-1));
+
+            // only send what the attempt that was cut short didn't get to commit
+            if (part_committed(dfc, server_num, part_name, len, &done) == 1) return PUT_STORED;
+        }
+        off_t sent = offset + done;
+
+        // send header so server knows file is coming, a server turning us away may already have hung up
+        sprintf(header, "CPUT %s %lu %s %lu", part_name, len, next, done);
+        if ((server_socket = request(dfc, server_num, header)) == REPLY_BUSY) continue;
+        if (server_socket < 0) return -1;
+
+        // send file part over
+        while (sent < end && tls_sendfile(server_socket, fd, &sent, end-sent) > 0);
+
+        // the ack only comes once the server, and its replica for a chain, have stored the part
+        if (tls_recv(server_socket, ack, BUFFERSIZE-1) <= 0 || sent < end) {
+            tls_close(server_socket);
+            continue;
+        }
+
+        if (!strcmp(ack, "PUT_OK") || !strcmp(ack, "PUT_LOCAL")) {
+            conn_put(dfc, server_num, server_socket);
+            return !strcmp(ack, "PUT_OK") && strcmp(next, "NULL") ? PUT_CHAINED : PUT_STORED;
+        }
+
+        tls_close(server_socket);
+        if (strcmp(ack, "BUSY")) return -1;
+    }
+
+    return -1;
+}
+
+static int stream_put(dfc_t* dfc, int server_num, char* header) {
+    char reply[BUFFERSIZE] = {0};
+    int reply_len = 0;
+    int server_socket;
+
+    if ((server_socket = request(dfc, server_num, header)) < 0) return server_socket;
+    while (reply_len < BUFFERSIZE-1 && tls_recv(server_socket, reply+reply_len, 1) > 0 && reply[reply_len++] != '\0');
+    if (reply_len && reply[reply_len-1] == '\0' && !strcmp(reply, "GO")) return server_socket;
+
+    tls_close(server_socket);
+    return !strcmp(reply, "BUSY") ? REPLY_BUSY : -1;
+}
+
+static int first_server(char* name) {
+    unsigned char hash_bin[MD5_DIGEST_LENGTH] = {0};
+    unsigned long long hash_offset = 0;
+
+    // hash filename to determine where to go
+    MD5_CTX md5_context;
+    MD5_Init(&md5_context);
+    MD5_Update(&md5_context, name, strlen(name));
+    MD5_Final(hash_bin, &md5_context);
+
+    for (int i = 0; i < 8; i++) hash_offset |= (unsigned long long)hash_bin[i] << (i * 8);
+    return hash_offset % NUM_SERVERS;
+}
+
+static int put_fd(dfc_t* dfc, int fd, unsigned long file_size, char* name, time_t put_time, int resume) {
+    int hash_offset = first_server(name);
+
+    //split file into chunks and send
+    int result = DFC_OK;
+    for (int file_part = 0; file_part < NUM_SERVERS; file_part++) {
+        char part_name[BUFFERSIZE*2];
+        char next[BUFFERSIZE*2];
+        off_t write_start = file_part*(file_size/NUM_SERVERS);
+        unsigned long write_end = (file_part+1)*(file_size/NUM_SERVERS);
+        int server_index = (hash_offset+file_part) % NUM_SERVERS;
+        int replica_index = (server_index+1) % NUM_SERVERS;
+        unsigned long done[2] = {0, 0}; // bytes of the part the primary and replica already have
+        int whole[2] = {0, 0};
+        if (file_part == NUM_SERVERS - 1) write_end = file_size;
+        unsigned long len = write_end-write_start;
+
+        sprintf(part_name, "%.10ld:%d:%s", put_time, file_part+1, name);
+        sprintf(next, "%s:%d", dfc->addrs[replica_index], dfc->ports[replica_index]);
+
+        // a resumed put only sends what each server is missing
+        if (resume) {
+            whole[0] = part_committed(dfc, server_index, part_name, len, &done[0]) == 1;
+            whole[1] = part_committed(dfc, replica_index, part_name, len, &done[1]) == 1;
+            if (whole[0] && whole[1]) continue;
+        }
+
+        // upload the part once to the primary, which passes it down the chain to the replica,
+        // and only send the replica's copy ourselves if the chain broke
+        int stored = whole[0] ? PUT_STORED : put_part(dfc, server_index, fd, part_name, write_start, len, done[0], whole[1] ? "NULL" : next);
+        if (stored == PUT_CHAINED || whole[1]) continue;
+
+        // the broken chain may have got part of the way, keep what the replica committed
+        if (part_committed(dfc, replica_index, part_name, len, &done[1]) == 1) continue;
+        if (put_part(dfc, replica_index, fd, part_name, write_start, len, done[1], "NULL") < 0 && stored < 0)
+            result = DFC_ERR_INCOMPLETE;
+    }
+
+    return result;
+}
+
+static int find_file(dfc_t* dfc, char* name, dfc_file_t* status) {
+    dfc_file_t* files;
+    int num_files;
+    int found = -1;
+
+    list_all(dfc, name, &files, &num_files);
+    for (int i = 0; i < num_files; i++) {
+        if (!strncmp(files[i].filename, name, BUFFERSIZE) && files[i].disp) {
+            *status = files[i];
+            found = 0;
+            break;
+        }
+    }
+
+    free(files);
+    return found;
+}
+
+static void* run_job(void* arg) {
+    dfc_job_t* job = (dfc_job_t*) arg;
+
+    if (job->op == JOB_LIST) {
+        dfc_file_t* files;
+        int num_files;
+        int result = dfc_list(job->dfc, &files, &num_files);
+        if (job->list_cb) job->list_cb(result, files, num_files, job->arg);
+        free(files);
+    } else {
+        int result;
+        if (job->op == JOB_PUT) result = dfc_put(job->dfc, job->path, job->name);
+        else result = dfc_get(job->dfc, job->name, job->path);
+        if (job->cb) job->cb(result, job->arg);
+    }
+
+    free(job);
+    return NULL;
+}
+
+static int start_job(dfc_job_t* job) {
+    pthread_t thread_id;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int result = pthread_create(&thread_id, &attr, run_job, job);
+    pthread_attr_destroy(&attr);
+
+    if (result != 0) {
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+static dfc_window_t* load_window(dfc_handle_t* h, unsigned long offset) {
+    dfc_window_t* w = NULL;
+
+    // the window may be here already, or on its way from a read ahead
+    for (int i = 0; i < 2; i++)
+        if (h->windows[i].state != WINDOW_EMPTY && offset >= h->windows[i].start && offset < h->windows[i].end)
+            w = &h->windows[i];
+
+    if (!w) {
+        // a read ahead still running into the window has to finish before it is reused
+        w = &h->windows[0];
+        if (w->state == WINDOW_LOADING) pthread_join(w->thread, NULL);
+        set_window(h, w, offset);
+
+        window_arg_t* window_arg = malloc(sizeof(window_arg_t)); // freed by fetch_window
+        window_arg->h = h;
+        window_arg->w = w;
+        fetch_window(window_arg);
+    } else if (w->state == WINDOW_LOADING) {
+        pthread_join(w->thread, NULL);
+    }
+
+    // only this thread changes state, the read ahead just leaves its result in fetched
+    if (w->state != WINDOW_READY && w->fetched < 0) {
+        set_window(h, w, w->start); // try again on the next read
+        return NULL;
+    }
+    w->state = WINDOW_READY;
+    return w;
+}
+
+static void read_ahead(dfc_handle_t* h, unsigned long offset) {
+    if (offset >= h->size) return;
+    for (int i = 0; i < 2; i++)
+        if (h->windows[i].state != WINDOW_EMPTY && offset >= h->windows[i].start && offset < h->windows[i].end) return;
+
+    // the window the reader isn't in is dropped for the next one, unless it is
+    // still loading from before a seek, then the next read fetches it instead
+    dfc_window_t* w = &h->windows[0];
+    if (w->state != WINDOW_EMPTY && h->pos >= w->start && h->pos < w->end) w = &h->windows[1];
+    if (w->state == WINDOW_LOADING) return;
+    set_window(h, w, offset);
+
+    window_arg_t* window_arg = malloc(sizeof(window_arg_t)); // freed by fetch_window
+    window_arg->h = h;
+    window_arg->w = w;
+    w->state = WINDOW_LOADING;
+    if (pthread_create(&w->thread, NULL, fetch_window, window_arg) != 0) {
+        w->state = WINDOW_EMPTY;
+        free(window_arg);
+    }
+}
+
+static void set_window(dfc_handle_t* h, dfc_window_t* w, unsigned long offset) {
+    unsigned long start, end;
+
+    // windows are counted from the start of their part, so none straddles two
+    part_range(h, part_of(h, offset), &start, &end);
+    w->start = start + (offset - start) / DFC_WINDOW * DFC_WINDOW;
+    w->end = end - w->start > DFC_WINDOW ? w->start + DFC_WINDOW : end;
+
+    free(w->data);
+    w->data = NULL;
+    w->len = 0;
+    w->state = WINDOW_EMPTY;
+}
+
+static void* fetch_window(void* arg) {
+    window_arg_t* window_arg = (window_arg_t*) arg;
+    dfc_handle_t* h = window_arg->h;
+    dfc_window_t* w = window_arg->w;
+    int part = part_of(h, w->start);
+
+    FILE* mem = open_memstream(&w->data, &w->len);
+    w->fetched = get_part(h->dfc, &h->status, part, mem, w->start - part*h->part_len, w->end - w->start);
+    fclose(mem);
+
+    free(window_arg);
+    return NULL;
+}
+
+static int part_of(dfc_handle_t* h, unsigned long offset) {
+    if (!h->part_len) return NUM_SERVERS-1; // files smaller than NUM_SERVERS bytes are all in the last part
+    int part = offset / h->part_len;
+    return part < NUM_SERVERS ? part : NUM_SERVERS-1;
+}
+
+static void part_range(dfc_handle_t* h, int part, unsigned long* start, unsigned long* end) {
+    *start = part * h->part_len;
+    *end = part == NUM_SERVERS-1 ? h->size : *start + h->part_len;
+}
+
+static int holder_size(dfc_handle_t* h, int part, unsigned long* size) {
+    int replicas[NUM_SERVERS];
+    char part_name[BUFFERSIZE*2];
+    int num_replicas = rank_replicas(h->dfc, h->status.holders[part], replicas);
+
+    sprintf(part_name, "%.10ld:%d:%s", h->status.time, part+1, h->status.filename);
+    for (int i = 0; i < num_replicas; i++)
+        if (stat_part(h->dfc, replicas[i], part_name, size) == 1) return 0;
+    return -1;
+}
+
+static long write_parts(dfc_handle_t* h, const char* buf, unsigned long len) {
+    unsigned long total = 0;
+    unsigned long start, end;
+
+    if (len > h->size - h->pos) len = h->size - h->pos;
+    while (h->part < NUM_SERVERS) {
+        part_range(h, h->part, &start, &end);
+
+        // a full buffer goes out behind the writes, and so does the end of a part, which moves on to the next
+        if (h->pos == end || h->buf_len == DFC_WINDOW) {
+            write_behind(h, h->pos == end);
+            continue;
+        }
+        if (total == len) break;
+
+        unsigned long n = len - total;
+        if (n > DFC_WINDOW - h->buf_len) n = DFC_WINDOW - h->buf_len;
+        if (n > end - h->pos) n = end - h->pos;
+        memcpy(h->bufs[h->buf] + h->buf_len, buf + total, n);
+        h->buf_len += n;
+        h->pos += n;
+        total += n;
+    }
+
+    return total;
+}
+
+static void write_behind(dfc_handle_t* h, int last) {
+    unsigned long start, end;
+    part_range(h, h->part, &start, &end);
+
+    // the buffer before this one has to be sent first, it may be on the same connection
+    flush_wait(h);
+    h->flush_data = h->bufs[h->buf];
+    h->flush_len = h->buf_len;
+    h->flush_part = h->part;
+    h->flush_first = h->pos - h->buf_len == start;
+    h->flush_last = last;
+    h->flushing = pthread_create(&h->flush_thread, NULL, flush_buffer, h) == 0;
+    if (!h->flushing) flush_buffer(h);
+
+    // while the other buffer takes the next writes
+    h->buf = !h->buf;
+    h->buf_len = 0;
+    if (last) h->part++;
+}
+
+static void* flush_buffer(void* arg) {
+    dfc_handle_t* h = (dfc_handle_t*) arg;
+    unsigned long start, end;
+    part_range(h, h->flush_part, &start, &end);
+
+    if (h->flush_first) {
+        char part_name[BUFFERSIZE*2];
+        char next[BUFFERSIZE*2];
+        char header[BUFFERSIZE*5];
+        int server_index = (first_server(h->name) + h->flush_part) % NUM_SERVERS;
+        int replica_index = (server_index+1) % NUM_SERVERS;
+
+        sprintf(part_name, "%.10ld:%d:%s", h->put_time, h->flush_part+1, h->name);
+        sprintf(next, "%s:%d", h->dfc->addrs[replica_index], h->dfc->ports[replica_index]);
+
+        // the primary passes the part down the chain to the replica, if it can't be reached the replica
+        // gets the only copy, nothing is sent until a server says GO so busy servers can be waited on
+        // without losing the buffer, which can't be sent twice
+        for (int attempt = 0; attempt <= BUSY_RETRIES; attempt++) {
+            if (attempt) usleep((BUSY_BACKOFF_MS * 1000) << (attempt-1));
+
+            sprintf(header, "SPUT %s %lu %s 0", part_name, end-start, next);
+            int busy = (h->sock = stream_put(h->dfc, h->sock_server = server_index, header)) == REPLY_BUSY;
+            if (h->sock >= 0) break;
+
+            sprintf(header, "SPUT %s %lu NULL 0", part_name, end-start);
+            busy |= (h->sock = stream_put(h->dfc, h->sock_server = replica_index, header)) == REPLY_BUSY;
+            if (h->sock >= 0 || !busy) break;
+        }
+        if (h->sock < 0) h->result = DFC_ERR_INCOMPLETE;
+    }
+
+    // the buffers sent before this one are gone, a connection that fails loses the part
+    unsigned long sent = 0;
+    while (h->sock >= 0 && sent < h->flush_len) {
+        ssize_t n = tls_send(h->sock, h->flush_data + sent, h->flush_len - sent);
+        if (n > 0) {
+            sent += n;
+        } else {
+            tls_close(h->sock);
+            h->sock = -1;
+            h->result = DFC_ERR_INCOMPLETE;
+        }
+    }
+
+    // the ack only comes once every copy asked for is stored
+    if (h->flush_last && h->sock >= 0) {
+        char ack[BUFFERSIZE] = {0};
+        if (tls_recv(h->sock, ack, BUFFERSIZE-1) > 0 && (!strcmp(ack, "PUT_OK") || !strcmp(ack, "PUT_LOCAL"))) {
+            conn_put(h->dfc, h->sock_server, h->sock);
+        } else {
+            tls_close(h->sock);
+            h->result = DFC_ERR_INCOMPLETE;
+        }
+        h->sock = -1;
+    }
+    return NULL;
+}
+
+static void flush_wait(dfc_handle_t* h) {
+    if (!h->flushing) return;
+    pthread_join(h->flush_thread, NULL);
+    h->flushing = 0;
+}
+
+static void journal_path(char* path, char journal[BUFFERSIZE*2]) {
+    snprintf(journal, BUFFERSIZE*2, "%s%s", path, JOURNAL_SUFFIX);
+}
+
+static void journal_write(char* journal, char* fmt, ...) {
+    va_list args;
+
+    // a journal that can't be written only costs the ability to resume
+    FILE* j = fopen(journal, "w");
+    if (!j) return;
+    va_start(args, fmt);
+    vfprintf(j, fmt, args);
+    va_end(args);
+    fclose(j);
+}
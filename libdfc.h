@@ -0,0 +1,82 @@
+// client library for the distributed file system, dfc is a thin wrapper around it
+
+#ifndef LIBDFC_H
+#define LIBDFC_H
+
+#include <time.h>
+
+#define DFC_BUFFERSIZE 2048 // longest file name, terminator included
+#define DFC_NUM_SERVERS 4
+#define DFC_WINDOW (1 << 20) // bytes a handle holds per buffer, a handle has two
+
+// results of the library calls
+#define DFC_OK 0
+#define DFC_ERR_LOCAL -1 // the local file could not be opened or created
+#define DFC_ERR_NOT_FOUND -2 // no server has the file
+#define DFC_ERR_INCOMPLETE -3 // some part of the file could not be stored or fetched
+
+// one version of a file as listed by the servers
+typedef struct {
+    char filename[DFC_BUFFERSIZE];
+    int parts[DFC_NUM_SERVERS];
+    int holders[DFC_NUM_SERVERS]; // bitmask of the servers that reported each part
+    int disp; // boolean to tell if it should be displayed
+    time_t time;
+} dfc_file_t;
+
+// a cluster of servers and everything learned about them, shared by every call made through it
+typedef struct dfc dfc_t;
+
+// a streaming handle on a remote file, opened for reading ('r') or writing ('w')
+typedef struct dfc_handle dfc_handle_t;
+
+typedef void (*dfc_callback_t)(int result, void* arg);
+typedef void (*dfc_list_callback_t)(int result, dfc_file_t* files, int num_files, void* arg);
+
+// read the server list from conf_file and set up the cluster, returns NULL if it can't be
+dfc_t* dfc_init(char* conf_file);
+
+// close pooled connections and free the cluster
+void dfc_free(dfc_t* dfc);
+
+// every version of every file on the cluster sorted by name, older versions have disp cleared,
+// *files is allocated and must be freed by the caller
+int  dfc_list(dfc_t* dfc, dfc_file_t** files, int* num_files);
+
+// store the local file at path on the cluster as name
+// until it succeeds a journal beside path (path.dfcj) lets a later put of the unchanged file send only what is missing
+int  dfc_put(dfc_t* dfc, char* path, char* name);
+
+// fetch the newest version of name from the cluster into the local file at path
+// until it succeeds a journal beside path (path.dfcj) lets a later get of the same version fetch only what is missing
+int  dfc_get(dfc_t* dfc, char* name, char* path);
+
+// the same operations run on their own thread, cb is called from that thread when they finish
+int  dfc_list_async(dfc_t* dfc, dfc_list_callback_t cb, void* arg);
+int  dfc_put_async(dfc_t* dfc, char* path, char* name, dfc_callback_t cb, void* arg);
+int  dfc_get_async(dfc_t* dfc, char* name, char* path, dfc_callback_t cb, void* arg);
+
+// open name for reading, or for writing a new version of size bytes (size is ignored for reading),
+// returns NULL if it cannot be read or the handle can't be set up
+// a read handle fetches a window at a time, with the next one fetched ahead of the reader,
+// a write handle sends each part as it is written, holding no more than its two buffers, to the part's
+// server which copies it down the chain to the replica, a part whose chain is broken is only stored once
+dfc_handle_t* dfc_open(dfc_t* dfc, char* name, int mode, unsigned long size);
+
+// read up to len bytes at the handle's position, returns the bytes read, 0 at the end or -1
+long dfc_read(dfc_handle_t* h, void* buf, unsigned long len);
+
+// write len bytes at the handle's position, returns the bytes written or -1
+// writes go in order and stop at the size given to dfc_open
+long dfc_write(dfc_handle_t* h, const void* buf, unsigned long len);
+
+// move the handle's position like lseek, returns the new position or -1
+// a write handle can't move, only report its position
+long dfc_seek(dfc_handle_t* h, long offset, int whence);
+
+// close the handle, waiting for a write handle's last part to be stored,
+// a write handle returns DFC_ERR_INCOMPLETE if it wasn't given size bytes or a part failed,
+// what was already sent of a part isn't kept, so the part can't be sent again
+int  dfc_close(dfc_handle_t* h);
+
+#endif // LIBDFC_H
@@ -0,0 +1,88 @@
+// internals of the client library, shared by its sources but not part of its interface
+
+#ifndef LIBDFC_PRIVATE_H
+#define LIBDFC_PRIVATE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+#include "libdfc.h"
+
+#define BUFFERSIZE DFC_BUFFERSIZE
+#define NUM_SERVERS DFC_NUM_SERVERS
+#define LATENCY_SAMPLES 64 // first byte latencies kept for the hedging percentile, per size class
+#define POOL_SIZE 4 // idle connections kept per server for reuse
+
+// size classes of gets, each keeps its own first byte latencies
+#define LATENCY_PART 0 // the rest of a part, by put and get
+#define LATENCY_WINDOW 1 // one window of a part, by read handles
+#define LATENCY_CLASSES 2
+
+// states of a window held by a read handle
+#define WINDOW_EMPTY 0
+#define WINDOW_LOADING 1
+#define WINDOW_READY 2
+
+// running latency estimates for one server
+typedef struct {
+    double rtt_ms; // smoothed connect time, 0 until first measured
+    double bytes_per_ms; // smoothed transfer throughput, 0 until first measured
+    int down; // last connect or transfer failed
+} server_stats_t;
+
+// a cluster of servers and everything learned about them, shared by every call made through it
+struct dfc {
+    char addrs[NUM_SERVERS][BUFFERSIZE];
+    int ports[NUM_SERVERS];
+    struct sockaddr_in serveraddrs[NUM_SERVERS]; // resolved once in dfc_init
+    server_stats_t stats[NUM_SERVERS];
+    double ttfb_samples[LATENCY_CLASSES][LATENCY_SAMPLES]; // rings of first byte latencies across all servers
+    int num_ttfb_samples[LATENCY_CLASSES];
+    unsigned long last_part_bytes; // size of the most recent part, used to estimate the next one
+    int pool[NUM_SERVERS][POOL_SIZE]; // idle connections ready for another request
+    int pool_len[NUM_SERVERS];
+    pthread_mutex_t mutex; // guards stats, pool and list_threads
+    pthread_cond_t list_idle; // signalled when list_threads drops to 0
+    int list_threads; // list threads still running, including those of lists given up on
+    SSL_CTX* tls; // set by a "tls <ca file>" line in the conf file, NULL for plaintext
+};
+
+// a window of a part held in memory by a read handle, at most DFC_WINDOW bytes
+typedef struct {
+    char* data;
+    size_t len;
+    unsigned long start, end; // the bytes of the file it holds, or is loading
+    int state;
+    int fetched; // result of the last fetch, 0 or -1
+    pthread_t thread; // read ahead fetching the window while state is WINDOW_LOADING
+} dfc_window_t;
+
+// a streaming handle on a remote file, opened for reading ('r') or writing ('w')
+struct dfc_handle {
+    dfc_t* dfc;
+    int mode;
+    char name[BUFFERSIZE];
+    unsigned long pos;
+    unsigned long size; // size of the file
+    unsigned long part_len; // size of every part but the last
+    dfc_file_t status; // reading: the version being read
+    dfc_window_t windows[2]; // reading: the window being read and the one read ahead of it
+    time_t put_time; // writing: the version being written
+    char* bufs[2]; // writing: the buffer taking writes and the one being sent behind it
+    int buf; // writing: which of bufs takes writes
+    unsigned long buf_len; // writing: bytes waiting in bufs[buf]
+    int part; // writing: the part bufs[buf] belongs to
+    int sock; // writing: connection the current part is streaming over, -1 if none
+    int sock_server;
+    int result; // writing: DFC_OK until a part fails to store
+    pthread_t flush_thread; // writing: sending the other buffer while flushing is set
+    int flushing;
+    char* flush_data; // writing: what flush_thread is sending, set before it starts
+    unsigned long flush_len;
+    int flush_part;
+    int flush_first; // starts its part
+    int flush_last; // ends its part
+};
+
+#endif // LIBDFC_PRIVATE_H
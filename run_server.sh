@@ -1,3 +1,4 @@
+export DFS_PEERS=127.0.0.1:10001,127.0.0.1:10002,127.0.0.1:10003,127.0.0.1:10004
 ./dfs ./dfs1 10001 &
 ./dfs ./dfs2 10002 &
 ./dfs ./dfs3 10003 &
@@ -0,0 +1,125 @@
+#include "sched.h"
+#include <string.h>
+#include <unistd.h>
+
+// share of the slots each class gets while all of them have requests waiting
+// replica legs never wait, so they are never dispatched
+static const int weights[NUM_CLASSES] = {8, 4, 1, 0};
+
+// hand free slots to waiting classes, lowest pass first, mutex must be held
+static void sched_dispatch(sched_t *s) {
+    while (s->running < SCHED_SLOTS) {
+        int best = -1;
+        for (int c = 0; c < NUM_CLASSES; c++) {
+            if (s->waiting[c] <= s->granted[c]) continue;
+            if (c == CLASS_BULK && s->running_class[c] >= SCHED_BULK_SLOTS) continue;
+            if (best < 0 || s->pass[c] < s->pass[best]) best = c;
+        }
+        if (best < 0) return;
+
+        s->global_pass = s->pass[best];
+        s->pass[best] += SCHED_STRIDE / weights[best];
+        s->granted[best]++;
+        s->running++;
+        s->running_class[best]++;
+        pthread_cond_signal(&s->ready[best]);
+    }
+}
+
+// queue for a slot and wait until one is granted, mutex must be held
+static void sched_wait(sched_t *s, sched_class_t c) {
+    // a class that was idle rejoins at the current pass instead of catching up on its idle time
+    if (s->waiting[c] == 0 && s->running_class[c] == 0 && s->pass[c] < s->global_pass)
+        s->pass[c] = s->global_pass;
+
+    s->waiting[c]++;
+    sched_dispatch(s);
+    while (!s->granted[c]) pthread_cond_wait(&s->ready[c], &s->mutex);
+    s->granted[c]--;
+    s->waiting[c]--;
+}
+
+int  sched_init(sched_t *s, long client_bw) {
+    if (s == NULL) return -1;
+
+    memset(s, 0, sizeof(sched_t));
+    pthread_mutex_init(&s->mutex, NULL);
+    for (int c = 0; c < NUM_CLASSES; c++) pthread_cond_init(&s->ready[c], NULL);
+    s->client_bw = client_bw;
+    return 0;
+}
+
+int  sched_admit(sched_t *s, sched_class_t c) {
+    pthread_mutex_lock(&s->mutex);
+      // a replica leg is turned away instead of queued, so its primary can
+      // tell the client to send that copy itself rather than keep a bulk slot waiting
+      if (c == CLASS_REPLICA) {
+        int full = s->running_class[c] >= SCHED_REPLICA_SLOTS;
+        if (!full) s->running_class[c]++;
+        pthread_mutex_unlock(&s->mutex);
+        return full ? -1 : 0;
+      }
+
+      // turn the request away now rather than let it sit behind a full queue
+      if (s->waiting[c] - s->granted[c] >= SCHED_QUEUE_LEN) {
+        pthread_mutex_unlock(&s->mutex);
+        return -1;
+      }
+
+      sched_wait(s, c);
+    pthread_mutex_unlock(&s->mutex);
+    return 0;
+}
+
+void sched_release(sched_t *s, sched_class_t c) {
+    pthread_mutex_lock(&s->mutex);
+      if (c != CLASS_REPLICA) s->running--;
+      s->running_class[c]--;
+      sched_dispatch(s);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+void sched_throttle(sched_t *s, sched_class_t c, in_addr_t client, unsigned long bytes) {
+    struct timeval now;
+    double wait = 0;
+
+    if (s->client_bw <= 0) return;
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&s->mutex);
+      // find the client's bucket, taking over the longest idle one for a new client
+      sched_client_t *bucket = &s->clients[0];
+      for (int i = 0; i < SCHED_MAX_CLIENTS; i++) {
+        if (s->clients[i].addr == client) {bucket = &s->clients[i]; break;}
+        if (timercmp(&s->clients[i].last, &bucket->last, <)) bucket = &s->clients[i];
+      }
+      if (bucket->addr != client) {
+        bucket->addr = client;
+        bucket->tokens = s->client_bw;
+        bucket->last = now;
+      }
+
+      // refill at client_bw bytes per second, holding at most one second's worth
+      double elapsed = (now.tv_sec - bucket->last.tv_sec) + (now.tv_usec - bucket->last.tv_usec) / 1e6;
+      bucket->tokens += elapsed * s->client_bw;
+      if (bucket->tokens > s->client_bw) bucket->tokens = s->client_bw;
+      bucket->last = now;
+
+      bucket->tokens -= bytes;
+      if (bucket->tokens < 0) wait = -bucket->tokens / s->client_bw;
+    pthread_mutex_unlock(&s->mutex);
+    if (wait <= 0) return;
+
+    // sleep without the slot so a client over its limit doesn't keep others from theirs,
+    // and queue for it again after, past the queue limit since the request is already under way
+    sched_release(s, c);
+    usleep(wait * 1e6);
+    pthread_mutex_lock(&s->mutex);
+      sched_wait(s, c);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+void sched_free(sched_t *s) {
+    for (int c = 0; c < NUM_CLASSES; c++) pthread_cond_destroy(&s->ready[c]);
+    pthread_mutex_destroy(&s->mutex);
+}
@@ -0,0 +1,64 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define SCHED_SLOTS 16 // requests serviced at once
+#define SCHED_BULK_SLOTS 12 // most slots bulk transfers may hold, the rest stay free for interactive requests
+#define SCHED_QUEUE_LEN 32 // requests that may wait per class before new ones are turned away busy
+#define SCHED_REPLICA_SLOTS 8 // replica legs of chain puts serviced at once, on top of SCHED_SLOTS
+#define SCHED_SMALL_READ (1 << 20) // gets of parts up to this size are small reads
+#define SCHED_MAX_CLIENTS 64 // clients tracked for bandwidth limits
+#define SCHED_STRIDE 1000.0
+
+// request classes, in order of priority
+// replica legs have slots of their own: their primary holds a bulk slot until they finish,
+// so making them wait for one could leave servers forwarding to each other all waiting
+typedef enum {
+    CLASS_METADATA,
+    CLASS_SMALL_READ,
+    CLASS_BULK,
+    CLASS_REPLICA,
+    NUM_CLASSES
+} sched_class_t;
+
+// token bucket limiting one client's bandwidth
+typedef struct {
+    in_addr_t addr;
+    double tokens;
+    struct timeval last;
+} sched_client_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t ready[NUM_CLASSES];
+    int running; // requests holding a slot
+    int running_class[NUM_CLASSES];
+    int waiting[NUM_CLASSES]; // requests queued, including those granted a slot but not yet woken
+    int granted[NUM_CLASSES]; // slots handed to a class and not yet taken by a waiter
+    double pass[NUM_CLASSES]; // stride scheduling position of each class, lowest goes next
+    double global_pass; // pass of the last class dispatched
+    long client_bw; // bytes per second per client, 0 for unlimited
+    sched_client_t clients[SCHED_MAX_CLIENTS];
+} sched_t;
+
+// initialize the scheduler
+int  sched_init(sched_t *s, long client_bw);
+
+// wait for a slot for a request of class c, returns -1 instead if its queue is full,
+// or for CLASS_REPLICA right away if its slots are all taken
+int  sched_admit(sched_t *s, sched_class_t c);
+
+// give back the slot of a request of class c
+void sched_release(sched_t *s, sched_class_t c);
+
+// account bytes moved for a client by a request of class c holding a slot, sleeping as long as needed
+// to keep it under its bandwidth with the slot given back meanwhile
+void sched_throttle(sched_t *s, sched_class_t c, in_addr_t client, unsigned long bytes);
+
+// free the scheduler's resources
+void sched_free(sched_t *s);
+
+#endif // SCHED_H
@@ -0,0 +1,268 @@
+#include "tls.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <openssl/x509v3.h>
+#include <openssl/err.h>
+
+// last session negotiated with one server, offered again on the next connection to it
+typedef struct {
+    SSL_CTX* ctx;
+    char peer[1024]; // host:port
+    SSL_SESSION* session;
+} tls_session_t;
+
+// TLS session of each socket, indexed by fd, NULL for plaintext sockets
+// a slot is only touched by the thread that owns the socket
+static SSL** conns;
+static int max_conns;
+static pthread_once_t conns_once = PTHREAD_ONCE_INIT;
+
+static tls_session_t sessions[TLS_SESSIONS];
+static int next_session; // slot replaced when a new peer needs one
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// hold SIGPIPE on the calling thread around a write that can't be given MSG_NOSIGNAL, so a peer that hung up
+// fails it with EPIPE instead of killing whatever program this is linked into, returns whether one was already pending
+static int sigpipe_block(sigset_t* old) {
+    sigset_t pipe_set, pending;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigpending(&pending);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, old);
+    return sigismember(&pending, SIGPIPE);
+}
+
+// discard the SIGPIPE the write raised, if any, before letting it through again, leaving the write's errno
+static void sigpipe_restore(sigset_t* old, int pending) {
+    int saved_errno = errno;
+    if (!pending) {
+        sigset_t pipe_set;
+        struct timespec none = {0, 0};
+        sigemptyset(&pipe_set);
+        sigaddset(&pipe_set, SIGPIPE);
+        sigtimedwait(&pipe_set, NULL, &none);
+    }
+    pthread_sigmask(SIG_SETMASK, old, NULL);
+    errno = saved_errno;
+}
+
+// sizes the socket table to the descriptor limit
+static void conns_init() {
+    struct rlimit rl;
+    max_conns = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? rl.rlim_cur : 65536;
+    conns = calloc(max_conns, sizeof(SSL*));
+}
+
+// settings shared by the server and client contexts
+static SSL_CTX* ctx_new(const SSL_METHOD* method) {
+    SSL_CTX* ctx = SSL_CTX_new(method);
+    if (!ctx) return NULL;
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    if (SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// bounds how long a handshake may block on a peer that stopped talking, 0 clears it
+static void handshake_timeout(int fd, int seconds) {
+    struct timeval timeout = {seconds, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+SSL_CTX* tls_server_ctx(char* cert_file, char* key_file) {
+    SSL_CTX* ctx = ctx_new(TLS_server_method());
+    if (!ctx) return NULL;
+
+    // clients reconnect often, session tickets let them skip the full handshake on any thread
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"dfs", strlen("dfs"));
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+SSL_CTX* tls_client_ctx(char* ca_file) {
+    SSL_CTX* ctx = ctx_new(TLS_client_method());
+    if (!ctx) return NULL;
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    if (SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+int  tls_accept(SSL_CTX* ctx, int fd) {
+    pthread_once(&conns_once, conns_init);
+    if (!conns || fd >= max_conns) return -1;
+
+    SSL* ssl = SSL_new(ctx);
+    if (!ssl) return -1;
+    SSL_set_fd(ssl, fd);
+
+    sigset_t mask;
+    handshake_timeout(fd, TLS_HANDSHAKE_TIMEOUT);
+    int pending = sigpipe_block(&mask);
+    int result = SSL_accept(ssl);
+    sigpipe_restore(&mask, pending);
+    if (result != 1) {
+        SSL_free(ssl);
+        return -1;
+    }
+    handshake_timeout(fd, 0);
+
+    conns[fd] = ssl;
+    return 0;
+}
+
+int  tls_connect(SSL_CTX* ctx, int fd, char* host, int port) {
+    char peer[1024];
+    int slot = -1;
+
+    pthread_once(&conns_once, conns_init);
+    if (!conns || fd >= max_conns) return -1;
+
+    SSL* ssl = SSL_new(ctx);
+    if (!ssl) return -1;
+    SSL_set_fd(ssl, fd);
+
+    // servers are listed by address or by name, check the certificate against whichever it is
+    if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host) != 1) {
+        SSL_set_tlsext_host_name(ssl, host);
+        SSL_set1_host(ssl, host);
+    }
+
+    // offer the last session with this server so the handshake can be abbreviated
+    snprintf(peer, sizeof(peer), "%s:%d", host, port);
+    pthread_mutex_lock(&sessions_mutex);
+      for (int i = 0; i < TLS_SESSIONS; i++)
+        if (sessions[i].ctx == ctx && !strcmp(sessions[i].peer, peer)) slot = i;
+      if (slot >= 0 && sessions[slot].session) SSL_set_session(ssl, sessions[slot].session);
+    pthread_mutex_unlock(&sessions_mutex);
+
+    // a server with no thread free hangs up without a word, it can't answer BUSY before the handshake,
+    // so a connection closed or reset at this point is told apart from one that failed verification
+    sigset_t mask;
+    handshake_timeout(fd, TLS_HANDSHAKE_TIMEOUT);
+    ERR_clear_error();
+    int pending = sigpipe_block(&mask);
+    errno = 0;
+    int result = SSL_connect(ssl);
+    sigpipe_restore(&mask, pending);
+    if (result != 1) {
+        int err = SSL_get_error(ssl, result);
+        int closed = (err == SSL_ERROR_SYSCALL && (errno == 0 || errno == ECONNRESET || errno == EPIPE)) ||
+                     (err == SSL_ERROR_SSL && ERR_GET_REASON(ERR_peek_last_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING);
+        SSL_free(ssl);
+        return closed ? TLS_CLOSED : -1;
+    }
+    handshake_timeout(fd, 0);
+
+    // keep the session for next time, a peer we haven't seen takes the oldest slot
+    SSL_SESSION* session = SSL_get1_session(ssl);
+    pthread_mutex_lock(&sessions_mutex);
+      if (slot < 0 || sessions[slot].ctx != ctx || strcmp(sessions[slot].peer, peer)) {
+        slot = next_session;
+        next_session = (next_session+1) % TLS_SESSIONS;
+        sessions[slot].ctx = ctx;
+        strcpy(sessions[slot].peer, peer);
+      }
+      if (sessions[slot].session) SSL_SESSION_free(sessions[slot].session);
+      sessions[slot].session = session;
+    pthread_mutex_unlock(&sessions_mutex);
+
+    conns[fd] = ssl;
+    return 0;
+}
+
+ssize_t tls_send(int fd, const void* buf, size_t len) {
+    SSL* ssl = conns && fd < max_conns ? conns[fd] : NULL;
+    if (!ssl) return send(fd, buf, len, MSG_NOSIGNAL);
+
+    sigset_t mask;
+    int pending = sigpipe_block(&mask);
+    int n = SSL_write(ssl, buf, len);
+    sigpipe_restore(&mask, pending);
+    return n > 0 ? n : -1;
+}
+
+ssize_t tls_recv(int fd, void* buf, size_t len) {
+    SSL* ssl = conns && fd < max_conns ? conns[fd] : NULL;
+    if (!ssl) return recv(fd, buf, len, 0);
+
+    // reading can send an alert back
+    sigset_t mask;
+    int pending = sigpipe_block(&mask);
+    int n = SSL_read(ssl, buf, len);
+    sigpipe_restore(&mask, pending);
+    if (n > 0) return n;
+    return SSL_get_error(ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+ssize_t tls_sendfile(int fd, int in_fd, off_t* offset, size_t count) {
+    SSL* ssl = conns && fd < max_conns ? conns[fd] : NULL;
+    sigset_t mask;
+    ssize_t n;
+
+    // sendfile has no MSG_NOSIGNAL
+    int pending = sigpipe_block(&mask);
+    if (!ssl) {
+        n = sendfile(fd, in_fd, offset, count);
+    } else if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        // with kernel TLS the file pages are encrypted on their way out, still without a copy through here
+        n = SSL_sendfile(ssl, in_fd, *offset, count, 0);
+        if (n > 0) *offset += n;
+        else n = -1;
+    } else {
+        // otherwise the file has to pass through user space to be encrypted
+        char buf[TLS_CHUNK];
+        if (count > TLS_CHUNK) count = TLS_CHUNK;
+        n = pread(in_fd, buf, count, *offset);
+        if (n > 0 && SSL_write(ssl, buf, n) <= 0) n = -1;
+        else if (n > 0) *offset += n;
+    }
+    sigpipe_restore(&mask, pending);
+    return n;
+}
+
+int  tls_pending(int fd) {
+    SSL* ssl = conns && fd < max_conns ? conns[fd] : NULL;
+    return ssl ? SSL_pending(ssl) : 0;
+}
+
+int  tls_close(int fd) {
+    SSL* ssl = conns && fd >= 0 && fd < max_conns ? conns[fd] : NULL;
+    if (ssl) {
+        // send our close_notify without waiting for the peer's, the socket is going away either way
+        sigset_t mask;
+        conns[fd] = NULL;
+        int pending = sigpipe_block(&mask);
+        SSL_shutdown(ssl);
+        sigpipe_restore(&mask, pending);
+        SSL_free(ssl);
+    }
+    return close(fd);
+}
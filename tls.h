@@ -0,0 +1,44 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+// kernel TLS in OpenSSL 3.0 only takes over both directions of a TLS 1.2 session using AES-GCM,
+// so that is all that is offered, anything else would leave sendfile copying through user space
+#define TLS_CIPHERS "ECDHE+AESGCM"
+#define TLS_SESSIONS 16 // peers whose last session is kept for resumption
+#define TLS_HANDSHAKE_TIMEOUT 5 // seconds a peer may take to complete a handshake
+#define TLS_CHUNK 16384 // bytes encrypted at a time by tls_sendfile without kernel TLS
+#define TLS_CLOSED -2 // tls_connect result: the peer hung up during the handshake, as a busy server does
+
+// only dfs and libdfc call these, they are kept out of the symbols libdfc exports
+#pragma GCC visibility push(hidden)
+
+// context for accepting connections with the certificate chain and key, NULL if they can't be loaded
+SSL_CTX* tls_server_ctx(char* cert_file, char* key_file);
+
+// context for connecting to servers whose certificates are signed by ca_file, NULL if it can't be loaded
+SSL_CTX* tls_client_ctx(char* ca_file);
+
+// handshake on an accepted socket, returns 0 or -1
+int  tls_accept(SSL_CTX* ctx, int fd);
+
+// handshake on a socket connected to host:port, resuming the last session with that server if there is one,
+// returns 0, TLS_CLOSED or -1
+int  tls_connect(SSL_CTX* ctx, int fd, char* host, int port);
+
+// send, recv and sendfile on a socket, through its TLS session if it has one
+ssize_t tls_send(int fd, const void* buf, size_t len);
+ssize_t tls_recv(int fd, void* buf, size_t len);
+ssize_t tls_sendfile(int fd, int in_fd, off_t* offset, size_t count);
+
+// bytes already decrypted and waiting to be read, which poll and select can't see
+int  tls_pending(int fd);
+
+// end a socket's TLS session, if any, and close it
+int  tls_close(int fd);
+
+#pragma GCC visibility pop
+
+#endif // TLS_H